@@ -0,0 +1,11 @@
+#pragma once
+#include <cstdint>
+
+namespace vw {
+
+// Creates and destroys device-local buffers from 1, 2, 4 .. maxThreadCount threads at once, each thread keeping a small window of live
+// buffers like a streaming loader would. Every thread count runs on an externally synchronized allocator behind a single mutex and on an
+// allocator with one stripe per thread, and the allocations per second of both are printed. Needs the device to be created
+void benchmarkConcurrentAllocation(uint32_t maxThreadCount, uint32_t allocationsPerThread);
+
+}  // namespace vw
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+namespace vw {
+
+// Encodes a tightly packed image of 8-bit texels into 4x4 blocks of format, which is one of the BC1 RGBA, BC3, BC4 or BC5 unorm formats.
+// BC1 and BC3 read RGBA texels, BC4 the first and BC5 the first two of channelCount channels. Partial blocks at the edges repeat the last
+// row and column
+std::vector<std::byte> compressImage(const std::byte* texels, uint32_t width, uint32_t height, uint32_t channelCount, vk::Format format);
+
+}  // namespace vw
@@ -42,8 +42,9 @@ class Fence : public vw::HandleContainerUnique<vk::Fence> {
   void reset() {
     vw::g::device.resetFences(mHandle);
   }
-  void wait() {
-    vw::g::device.waitForFences(mHandle, true, 1000000);
+  // Blocks until the fence is signaled by default, returns vk::Result::eTimeout otherwise
+  vk::Result wait(uint64_t timeout = UINT64_MAX) const {
+    return vw::g::device.waitForFences(mHandle, true, timeout);
   }
 };
 
@@ -1,17 +1,19 @@
 #pragma once
+#include <algorithm>
 #include <array>
 #include <cinttypes>
 #include <cstddef>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
 #include <memory>
 #include <vulkan/vulkan.hpp>
+#include "vkfile.hpp"
 #include "vkutils.hpp"
 
 namespace vw {
 namespace dds {
 using DWORD = uint32_t;
-DWORD toDWORD(const std::byte* bytes) {
+inline DWORD toDWORD(const std::byte* bytes) {
   return *reinterpret_cast<const DWORD*>(bytes);
 }
 constexpr DWORD toDWORD(const char* chars) {
@@ -53,6 +55,8 @@ struct alignas(DWORD) Header {
     Depth = 0x800000,
     Texture = Caps | Height | Width | PixelFormat
   };
+  // In caps[1]
+  static constexpr DWORD kCaps2Cubemap = 0x200;
   DWORD size;
   DWORD flags;
   DWORD height;
@@ -329,24 +333,12 @@ struct alignas(DWORD) HeaderDX10 {
 
 class DDSFile : public vw::ImageFile {
  public:
-  DDSFile(const std::filesystem::path& path) {
-    if (!std::filesystem::exists(path))
-      throw std::runtime_error("DDS file " + path.string() + " does not exist!");
-    if (!std::filesystem::is_regular_file(path))
-      throw std::runtime_error("DDS file " + path.string() + " is not a regular file!");
-
-    mPath = path;
-    mFileSize = std::filesystem::file_size(path);
-    if (mFileSize < sizeof(FileStart)) {
+  // The file stays mapped until the DDSFile is destroyed, loadData copies the payload from the page cache in a single pass
+  DDSFile(const std::filesystem::path& path) : mFile{path, vw::FileAccess::Sequential} {
+    if (mFile.size() < sizeof(FileStart)) {
       throw std::runtime_error("Invalid dds file size: " + path.string());
     }
-
-    std::ifstream file{path, std::ios::binary | std::ios::in};
-    std::byte fileStartBytes[sizeof(FileStart)];
-    if (!file || !file.read(reinterpret_cast<char*>(&fileStartBytes), sizeof(FileStart))) {
-      throw std::runtime_error("Could not read dds header: " + path.string());
-    }
-    mFileStart = FileStart::fromBytes(fileStartBytes);
+    mFileStart = FileStart::fromBytes(mFile.data());
     if (!mFileStart.verify())
       throw std::runtime_error("Invalid dds file: " + path.string());
 
@@ -354,32 +346,45 @@ class DDSFile : public vw::ImageFile {
     auto& pixelFormat = header.pixelFormat;
     mIsDX10 = (pixelFormat.flags & PixelFormat::FourCC) && (pixelFormat.fourCC == PixelFormat::CC::DX10);
 
-    mDataSize = mFileSize - sizeof(FileStart);
-    mDataStart = file.tellg();
+    mDataStart = sizeof(FileStart);
     if (mIsDX10) {
-      if (mFileSize < (sizeof(FileStart) + sizeof(HeaderDX10))) {
+      if (mFile.size() < (sizeof(FileStart) + sizeof(HeaderDX10))) {
         throw std::runtime_error("Invalid DX10 dds file size: " + path.string());
       }
-      mDataSize -= sizeof(HeaderDX10);
-      std::byte headerDX10Bytes[sizeof(HeaderDX10)];
-      if (file.read(reinterpret_cast<char*>(&headerDX10Bytes), sizeof(HeaderDX10))) {
-        throw std::runtime_error("Could not read dds dx10 header: " + path.string());
-      }
-      mHeaderDX10 = HeaderDX10::fromBytes(headerDX10Bytes);
-      mDataStart = file.tellg();
+      mHeaderDX10 = HeaderDX10::fromBytes(mFile.data() + mDataStart);
+      mDataStart += sizeof(HeaderDX10);
     }
+
+    if ((header.flags & Header::MipMapCount) && header.mipMapCount > 0)
+      mMipLevels = std::min(header.mipMapCount, vw::getMaxMipLevels(getExtent()));
+    // Cube faces are uploaded as consecutive layers
+    if (mIsDX10) {
+      mArrayLayers = std::max(mHeaderDX10.arraySize, 1u);
+      if (mHeaderDX10.miscFlag & HeaderDX10::ResourceMiscTextureCube)
+        mArrayLayers *= 6;
+    } else if (header.caps[1] & Header::kCaps2Cubemap) {
+      mArrayLayers = 6;
+    }
+    mDataSize = getSubresourcesSize();
+    if (mFile.size() - mDataStart < mDataSize)
+      throw std::runtime_error("Truncated dds file: " + path.string());
   }
   size_t dataSize() const override {
     return mDataSize;
   }
   void loadData(std::byte* dst) const override {
-    std::ifstream file{mPath, std::ios::binary | std::ios::in};
-    file.seekg(mDataStart);
-    file.read(reinterpret_cast<char*>(dst), mDataSize);
+    std::memcpy(dst, mFile.data() + mDataStart, mDataSize);
+  }
+  bool hasRangedLoad() const override {
+    return true;
+  }
+  void loadRange(vk::DeviceSize offset, vk::DeviceSize size, std::byte* dst) const override {
+    std::memcpy(dst, mFile.data() + mDataStart + offset, size);
   }
   vk::Format getFormat() const override {
     if (mIsDX10) {
-      return kDDSFormatToVkFormat[static_cast<size_t>(mHeaderDX10.format)];
+      auto index = static_cast<size_t>(mHeaderDX10.format);
+      return (index < std::size(kDDSFormatToVkFormat)) ? kDDSFormatToVkFormat[index] : vk::Format::eUndefined;
     }
     if (mFileStart.header.pixelFormat.flags & PixelFormat::FourCC) {
       DWORD fourCC = mFileStart.header.pixelFormat.fourCC;
@@ -401,14 +406,21 @@ class DDSFile : public vw::ImageFile {
   vk::Extent3D getExtent() const override {
     return {mFileStart.header.width, mFileStart.header.height, 1};
   }
+  uint32_t getMipLevels() const override {
+    return mMipLevels;
+  }
+  uint32_t getArrayLayers() const override {
+    return mArrayLayers;
+  }
 
  private:
-  std::filesystem::path mPath;
+  vw::MappedFile mFile;
   FileStart mFileStart = {};
   HeaderDX10 mHeaderDX10 = {};
-  size_t mFileSize = 0;
+  size_t mDataStart = 0;
   size_t mDataSize = 0;
-  std::ifstream::pos_type mDataStart;
+  uint32_t mMipLevels = 1;
+  uint32_t mArrayLayers = 1;
   bool mIsDX10 = false;
 };
 };  // namespace dds
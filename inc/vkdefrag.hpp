@@ -0,0 +1,105 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+#include "vkcore.hpp"
+#include "vkmemory.hpp"
+
+namespace vw {
+
+// Compacts VMA's memory blocks by moving the allocations of registered buffers and images, a pass at a time. A pass copies at most
+// maxBytesPerFrame bytes in the command buffer of one frame, switches the resources to the new handles once that frame's fence signaled and
+// releases the old memory after frameCount more frames, so nothing ever waits on the GPU. The vw::Buffer and vw::Image objects stay the same,
+// only their handles change: onMoved runs right after the switch, and descriptor sets that reference moved resources have to be written again
+// when getGeneration() changed since they were last written. Registered resources may be destroyed on any thread, every call is serialized
+class Defragmenter {
+ public:
+  Defragmenter(MemoryAllocator& allocator, uint32_t frameCount, vk::DeviceSize maxBytesPerFrame);
+  // The device has to be idle and no registered resource may be destroyed concurrently
+  ~Defragmenter();
+  Defragmenter(const Defragmenter& other) = delete;
+  Defragmenter& operator=(const Defragmenter& other) = delete;
+  // Only resources the GPU never writes after their upload can be moved, they need transfer source and destination usage. Returns false for
+  // mapped buffers and allocations outside of DEVICE_LOCAL memory, which stay where they are. setDebugInfo has to be called before
+  bool add(vw::Buffer& buffer, std::function<void()> onMoved = {});
+  // The image has to be in layout whenever a frame begins
+  bool add(vw::Image& image, vk::ImageLayout layout = vk::ImageLayout::eShaderReadOnlyOptimal, std::function<void()> onMoved = {});
+  // Called by the destructors of registered resources. VMA must not see their allocations freed while a pass is open, so the defragmenter
+  // takes them over and frees them once the pass ended
+  void remove(vw::Buffer& buffer);
+  void remove(vw::Image& image);
+  // Keeps an object that frames in flight may still use, like the old view of a moved image, alive until the old handles are destroyed.
+  // Meant to be called from onMoved
+  void retire(std::shared_ptr<void> object) {
+    std::lock_guard<std::recursive_mutex> lock{mMutex};
+    mRetired.push_back(std::move(object));
+  }
+  // Once the slot of the frame is free to be reused. Switches the handles when the last pass' copies finished, or ends the pass once no
+  // frame in flight can use the old handles anymore
+  void beginFrame();
+  // Plans the next pass and records its copies before anything else of the frame, does nothing while a pass is still going on
+  void record(vk::CommandBuffer cmdBuffer);
+  // The submission holding the recorded commands of this frame
+  void endFrame(std::shared_ptr<vw::Fence> fence);
+  uint64_t getGeneration() const {
+    std::lock_guard<std::recursive_mutex> lock{mMutex};
+    return mGeneration;
+  }
+  // Totals over all passes that ended so far
+  VmaDefragmentationStats getStats() const {
+    std::lock_guard<std::recursive_mutex> lock{mMutex};
+    return mStats;
+  }
+
+ private:
+  enum class State { Idle, Recorded, Copying, Retiring };
+  struct Resource {
+    vw::Buffer* buffer = nullptr;
+    vw::Image* image = nullptr;
+    vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+    std::function<void()> onMoved;
+  };
+  struct Move {
+    vw::Buffer* buffer = nullptr;
+    vw::Image* image = nullptr;
+    vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+    std::function<void()> onMoved;
+    vk::Buffer oldBuffer, newBuffer;
+    vk::Image oldImage, newImage;
+    // The resource was destroyed during the pass, its new handle goes with the old one
+    bool orphaned = false;
+  };
+  // A registered resource destroyed while the pass was open, the handle is null when the move already owns it
+  struct Orphan {
+    vk::Buffer buffer;
+    vk::Image image;
+    VmaAllocation allocation = VK_NULL_HANDLE;
+    MemoryCategory category = MemoryCategory::Other;
+  };
+  static VmaAllocation getAllocation(const Resource& resource);
+  void recordCopies(vk::CommandBuffer cmdBuffer) const;
+  void switchHandles();
+  void endPass();
+  // Recursive because onMoved runs under the lock and usually calls retire
+  mutable std::recursive_mutex mMutex;
+  MemoryAllocator& mAllocator;
+  uint32_t mFrameCount;
+  vk::DeviceSize mMaxBytesPerFrame;
+  std::vector<Resource> mResources;
+  State mState = State::Idle;
+  VmaDefragmentationContext mContext = VK_NULL_HANDLE;
+  std::vector<Move> mMoves;
+  std::vector<Orphan> mOrphans;
+  std::shared_ptr<vw::Fence> mCopyFence;
+  uint32_t mRetireFrames = 0;
+  // Frames left before planning again after a pass found nothing to move
+  uint32_t mIdleFrames = 0;
+  uint64_t mGeneration = 0;
+  std::vector<std::shared_ptr<void>> mRetired;
+  VmaDefragmentationStats mPassStats{};
+  VmaDefragmentationStats mStats{};
+};
+
+}  // namespace vw
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+
+namespace vw {
+
+// How the mapped bytes are going to be read, lets the OS pick read-ahead and eviction
+enum class FileAccess { Default, Sequential };
+
+// Read-only view of a whole file mapped into the address space, pages are read straight from the page cache on first touch
+class MappedFile {
+ public:
+  // Sequential files of at least kPrefetchThreshold bytes are also prefetched in the background
+  static constexpr size_t kPrefetchThreshold = 1 << 20;
+  MappedFile(const std::filesystem::path& path, FileAccess access = FileAccess::Default);
+  ~MappedFile();
+  MappedFile(const MappedFile& other) = delete;
+  MappedFile& operator=(const MappedFile& other) = delete;
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+  const std::byte* data() const {
+    return mData;
+  }
+  size_t size() const {
+    return mSize;
+  }
+  const std::byte* begin() const {
+    return mData;
+  }
+  const std::byte* end() const {
+    return mData + mSize;
+  }
+
+ private:
+  void unmap();
+  const std::byte* mData = nullptr;
+  size_t mSize = 0;
+};
+
+}  // namespace vw
@@ -1,7 +1,12 @@
 #pragma once
 #include <vk_mem_alloc.h>
+#include <array>
+#include <atomic>
+#include <filesystem>
 #include <functional>
 #include <future>
+#include <mutex>
+#include <numeric>
 #include <vulkan/vulkan.hpp>
 #include "vkcore.hpp"
 #include "vkutils.hpp"
@@ -14,6 +19,7 @@ namespace BufferUse {
 constexpr vk::BufferUsageFlags kStagingBuffer = vk::BufferUsageFlagBits::eTransferSrc;
 constexpr vk::BufferUsageFlags kUniformBuffer = vk::BufferUsageFlagBits::eUniformBuffer;
 constexpr vk::BufferUsageFlags kStorageBuffer = vk::BufferUsageFlagBits::eStorageBuffer;
+constexpr vk::BufferUsageFlags kDeviceStorageBuffer = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst;
 constexpr vk::BufferUsageFlags kVertexBuffer = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst;
 constexpr vk::BufferUsageFlags kIndexBuffer = vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst;
 }  // namespace BufferUse
@@ -22,24 +28,98 @@ namespace ImageUse {
 constexpr vk::ImageUsageFlags kTexture = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst;
 }
 
+class Defragmenter;
+
+// What an allocation holds, memory usage is reported per category and heap
+enum class MemoryCategory { Other, Geometry, SceneData, Texture, RenderTarget, Staging, FrameData, MaxEnum };
+const char* toString(MemoryCategory category);
+
 class MemoryAllocator {
  public:
-  MemoryAllocator();
+  // memoryBudget takes the heap budgets from VK_EXT_memory_budget, which has to be enabled on the device, VMA estimates them otherwise.
+  // With allocationStripes = 0 all allocations and frees have to come from one thread at a time. Otherwise buffers and images can be created
+  // and destroyed from any thread: every thread allocates from the custom pools of one of the stripes, so threads on different stripes never
+  // share a block list. Each stripe keeps its own blocks per memory type. When the pool of the best memory type cannot allocate, the next
+  // suitable type is tried like VMA does for its default pools, so a full DEVICE_LOCAL heap still spills into host memory
+  MemoryAllocator(bool memoryBudget = false, uint32_t allocationStripes = 0);
   ~MemoryAllocator();
+  MemoryAllocator(const MemoryAllocator& other) = delete;
+  MemoryAllocator& operator=(const MemoryAllocator& other) = delete;
   VmaAllocator getHandle() {
     return mHandle;
   }
+  struct Usage {
+    uint64_t allocationCount = 0;
+    vk::DeviceSize bytes = 0;
+  };
+  // vmaCreateBuffer and vmaCreateImage, from the calling thread's stripe when there are allocation stripes
+  VkResult createBuffer(const vk::BufferCreateInfo& bufferInfo,
+                        VmaAllocationCreateInfo allocationInfo,
+                        VkBuffer& buffer,
+                        VmaAllocation& allocation,
+                        VmaAllocationInfo& info);
+  VkResult createImage(const vk::ImageCreateInfo& imageInfo,
+                       VmaAllocationCreateInfo allocationInfo,
+                       VkImage& image,
+                       VmaAllocation& allocation,
+                       VmaAllocationInfo& info);
+  // Buffers and images register their allocations themselves, see setDebugInfo
+  void track(VmaAllocation allocation, MemoryCategory category);
+  void untrack(VmaAllocation allocation, MemoryCategory category);
+  Usage getUsage(MemoryCategory category) const;
+  Usage getUsage(MemoryCategory category, uint32_t heapIndex) const;
+  // Usage and budget of every memory heap
+  std::vector<VmaBudget> getHeapBudgets() const;
+  // Free space inside the memory blocks of all heaps
+  struct Fragmentation {
+    uint32_t blockCount = 0;
+    vk::DeviceSize blockBytes = 0;
+    vk::DeviceSize unusedBytes = 0;
+    uint32_t unusedRangeCount = 0;
+    vk::DeviceSize largestUnusedRange = 0;
+    // 0 when the unused bytes form a single range, close to 1 when they are scattered over many small ones
+    float ratio() const {
+      return (unusedBytes > 0) ? 1.0f - static_cast<float>(largestUnusedRange) / static_cast<float>(unusedBytes) : 0.0f;
+    }
+  };
+  Fragmentation getFragmentation() const;
+  // Refreshes the budgets once per frame when VK_EXT_memory_budget is in use
+  void setFrameIndex(uint32_t frameIndex);
+  // VMA's detailed statistics with the category totals, heap budgets and fragmentation added under "Categories", "HeapBudgets" and
+  // "Fragmentation"
+  std::string getReportJson() const;
+  void writeReport(const std::filesystem::path& path) const;
 
  private:
+  struct Stripe {
+    std::mutex mutex;
+    // Indexed by memory type, created on first use
+    std::vector<VmaPool> pools;
+  };
+  // Counters are updated from every allocating thread
+  struct AtomicUsage {
+    std::atomic<uint64_t> allocationCount{0};
+    std::atomic<vk::DeviceSize> bytes{0};
+  };
+  VkResult selectStripePool(uint32_t memoryTypeBits, VmaAllocationCreateInfo& allocationInfo, uint32_t& memoryTypeIndex);
+  template <typename AllocateFunc>
+  VkResult allocateFromStripe(uint32_t memoryTypeBits, VmaAllocationCreateInfo& allocationInfo, AllocateFunc allocate);
   VmaAllocator mHandle = VK_NULL_HANDLE;
+  std::vector<uint32_t> mMemoryTypeHeaps;
+  // Indexed by heap, then category
+  std::vector<std::array<AtomicUsage, static_cast<size_t>(MemoryCategory::MaxEnum)>> mHeapUsage;
+  std::vector<Stripe> mStripes;
 };
 
 class Buffer : public vw::HandleContainerUnique<vk::Buffer> {
  public:
+  // directUpload first tries mapped DEVICE_LOCAL | HOST_VISIBLE memory within the heap budget (resizable BAR, integrated and software GPUs)
+  // and falls back to memoryUsage, isMapped tells which one it got
   Buffer(MemoryAllocator& allocator,
          vw::ArrayProxy<vk::DeviceSize> segmentSizes,
          vk::BufferUsageFlags usage,
-         VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY);
+         VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
+         bool directUpload = false);
   ~Buffer();
   Buffer(const Buffer& other) = delete;
   Buffer& operator=(const Buffer& other) = delete;
@@ -52,18 +132,41 @@ class Buffer : public vw::HandleContainerUnique<vk::Buffer> {
     auto* dest = reinterpret_cast<typename T::value_type*>(mMappedPtr + mSegmentBase[segmentIdx] + segmentOffset);
     std::copy(std::begin(src), std::end(src), dest);
   }
+  // Reads back what the device wrote, memory that is not HOST_COHERENT is invalidated first
+  template <typename T>
+  void copyFromMapped(T& dst, size_t segmentIdx = 0, vk::DeviceSize segmentOffset = 0) const {
+    assert(mMappedPtr != nullptr);
+    assert(segmentIdx < mSegmentBase.size());
+    vk::DeviceSize dstSize = vw::byteSize(dst);
+    assert(segmentOffset + dstSize <= mSegmentSizes[segmentIdx]);
+    vk::DeviceSize offset = mSegmentBase[segmentIdx] + segmentOffset;
+    vmaInvalidateAllocation(mAllocator, mAllocation, offset, dstSize);
+    auto* src = reinterpret_cast<const typename T::value_type*>(mMappedPtr + offset);
+    std::copy(src, src + std::size(dst), std::begin(dst));
+  }
   vk::DescriptorBufferInfo getSegmentDesc(size_t idx) const {
     return {mHandle, mSegmentBase[idx], mSegmentSizes[idx]};
   }
+  bool isMapped() const {
+    return mMappedPtr != nullptr;
+  }
+  // Moves the allocation to category in the memory report, name shows up in VMA's detailed map
+  void setDebugInfo(MemoryCategory category, const std::string& name = {});
 
  protected:
+  friend class Defragmenter;
   vw::FixedVec<vk::DeviceSize> mSegmentBase;
   vw::FixedVec<vk::DeviceSize> mSegmentSizes;
   vk::DeviceSize mAlignment;
+  MemoryAllocator& mMemoryAllocator;
   VmaAllocator mAllocator;
   VmaAllocation mAllocation;
   VmaAllocationInfo mAllocationInfo;
+  MemoryCategory mCategory = MemoryCategory::Other;
   std::byte* mMappedPtr;
+  // Kept to create the handle again when the allocation is moved
+  vk::BufferCreateInfo mCreateInfo;
+  Defragmenter* mDefragmenter = nullptr;
 };
 
 class ImageView : public vw::HandleContainerUnique<vk::ImageView> {
@@ -84,6 +187,13 @@ class Image : public vw::HandleContainerUnique<vk::Image> {
         uint32_t arrayLayers = 1,
         VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY);
   ~Image();
+  // Barrier for a layout transition, adds the stages it waits on and blocks to srcStages and dstStages so barriers can be batched
+  static vk::ImageMemoryBarrier getLayoutBarrier(vk::Image image,
+                                                 vk::ImageLayout oldLayout,
+                                                 vk::ImageLayout newLayout,
+                                                 vk::ImageSubresourceRange range,
+                                                 vk::PipelineStageFlags& srcStages,
+                                                 vk::PipelineStageFlags& dstStages);
   static void transitionLayout(vk::CommandBuffer cmdBuffer,
                                vk::Image image,
                                vk::ImageLayout oldLayout,
@@ -104,28 +214,59 @@ class Image : public vw::HandleContainerUnique<vk::Image> {
   vw::ImageView createView(vk::ImageViewType viewType = vk::ImageViewType::e2D,
                            vk::ImageSubresourceRange range = kDefaultSubResourceRange,
                            vk::ComponentMapping components = {}) const;
+  // Moves the allocation to category in the memory report, name shows up in VMA's detailed map
+  void setDebugInfo(MemoryCategory category, const std::string& name = {});
 
  private:
-  vk::Extent3D mExtent;
-  vk::Format mFormat;
+  friend class Defragmenter;
+  vk::ImageCreateInfo mCreateInfo;
+  MemoryAllocator& mMemoryAllocator;
   VmaAllocator mAllocator;
   VmaAllocation mAllocation;
   VmaAllocationInfo mAllocationInfo;
+  MemoryCategory mCategory = MemoryCategory::Other;
+  Defragmenter* mDefragmenter = nullptr;
 };
 
 class StagingBuffer : public vw::Buffer {
  public:
-  StagingBuffer(MemoryAllocator& allocator, vk::DeviceSize size, vw::Queue& transferQueue)
-      : vw::Buffer{allocator, size, vw::BufferUse::kStagingBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU}, mTransferQueue{transferQueue} {}
+  // mipQueue has to support graphics, vkCmdBlitImage is not available on transfer-only queues. Flushes that generate mips are submitted there.
+  // The buffer is split into regionCount equal regions that are filled round robin, so writes to the next region overlap the copies of the
+  // previous ones. Both queues need a one-time command buffer per region
+  StagingBuffer(MemoryAllocator& allocator, vk::DeviceSize size, vw::Queue& transferQueue, vw::Queue* mipQueue = nullptr, uint32_t regionCount = 1);
+  ~StagingBuffer();
+  // Mips are generated with linear blits, so the format needs blit and linear filter support with optimal tiling
+  bool canGenerateMips(vk::Format format) const;
+  // Writes mapped buffers in place and stages a copy to the segment for all others
+  template <typename T>
+  void queueBufferWrite(const T& src, vw::Buffer& dst, size_t segmentIdx = 0) {
+    if (vw::byteSize(src) == 0)
+      return;
+    if (dst.isMapped())
+      dst.copyToMapped(src, segmentIdx);
+    else
+      queueBufferCopy(src, dst, dst.getSegmentDesc(segmentIdx).offset);
+  }
+  // Data larger than a region is copied in chunks, each filling what is left of the current region
   template <typename T>
   void queueBufferCopy(const T& src, vk::Buffer dst, vk::DeviceSize dstOffset = 0) {
     vk::DeviceSize dataSize = vw::byteSize(src);
-    if (dataSize > mSegmentSizes[0])
-      throw std::runtime_error("Data size exceeds staging buffer size");
-    if (dataSize > remainingSpace())
+    if (dataSize == 0)
+      return;
+    if (dataSize > remainingSpace() && dataSize <= mRegionSize)
       flush();
-    vk::DeviceSize srcOffset = copyToMappedEnd(src);
-    mStagedBufferCopies.push_back({dst, vk::BufferCopy{srcOffset, dstOffset, vw::byteSize(src)}});
+    const std::byte* srcBytes = reinterpret_cast<const std::byte*>(std::data(src));
+    while (dataSize > 0) {
+      if (remainingSpace() == 0)
+        flush();
+      vk::DeviceSize chunkSize = std::min(dataSize, remainingSpace());
+      std::memcpy(mMappedPtr + mUsedBytes, srcBytes, chunkSize);
+      mStagedBufferCopies.push_back({dst, vk::BufferCopy{mUsedBytes, dstOffset, chunkSize}});
+      mUsedBytes += chunkSize;
+      srcBytes += chunkSize;
+      dstOffset += chunkSize;
+      dataSize -= chunkSize;
+    }
   }
   template <typename T>
   void queueBufferCopies(const T& srcs, vk::Buffer dst, vk::DeviceSize baseDstOffset = 0) {
@@ -133,7 +274,7 @@ class StagingBuffer : public vw::Buffer {
     for (const auto& src : srcs)
       totalSize += vw::byteSize(src);
 
-    if (totalSize > mSegmentSizes[0]) {
+    if (totalSize > mRegionSize) {
       vk::DeviceSize dstOffset = baseDstOffset;
       for (const auto& src : srcs) {
         queueBufferCopy(src, dst, dstOffset);
@@ -148,53 +289,104 @@ class StagingBuffer : public vw::Buffer {
       mStagedBufferCopies.push_back({dst, vk::BufferCopy{srcOffset, baseDstOffset, totalSize}});
     }
   }
+  // Uploads every mip level and layer of the file, layers.mipLevel and layers.baseArrayLayer select where the first subresource goes and
+  // destOffset is given in base level texels. generatedMipLevels more levels are blitted from the file's last one on flush, which needs a
+  // whole-image upload and canGenerateMips. Files larger than a region are copied in bands of block rows over several flushes
   void queueImageCopy(const ImageFile& imageFile,
                       vk::Image dst,
                       vk::ImageLayout preLayout = vk::ImageLayout::eUndefined,
                       vk::ImageLayout postLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
                       vk::ImageSubresourceLayers layers = kDefaultImageLayers,
-                      vk::Offset3D destOffset = {}) {
-    // Align to 16 bytes (texel size)
-    mUsedBytes = (mUsedBytes + 15) & ~15;
-    vk::DeviceSize imageDataSize = imageFile.dataSize();
-    if (imageDataSize > mSegmentSizes[0])
-      throw std::runtime_error("Image data size exceeds staging buffer size");
-    if (imageDataSize > remainingSpace())
+                      vk::Offset3D destOffset = {},
+                      uint32_t generatedMipLevels = 0) {
+    if (!fitsRegion(imageFile))
+      queueImageCopyInBands(imageFile, dst, preLayout, postLayout, layers, destOffset, generatedMipLevels);
+    else
+      loadStagedImage(imageFile, reserveImageCopy(imageFile, dst, preLayout, postLayout, layers, destOffset, generatedMipLevels));
+  }
+  // Same as queueImageCopy but leaves writing the data to the caller through loadStagedImage, which may happen on any thread as long as it
+  // is done before the next flush. Flushes first when the data does not fit, see fitsImage. The file has to fit into a region
+  std::byte* reserveImageCopy(const ImageFile& imageFile,
+                              vk::Image dst,
+                              vk::ImageLayout preLayout = vk::ImageLayout::eUndefined,
+                              vk::ImageLayout postLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+                              vk::ImageSubresourceLayers layers = kDefaultImageLayers,
+                              vk::Offset3D destOffset = {},
+                              uint32_t generatedMipLevels = 0) {
+    if (generatedMipLevels > 0 && (!canGenerateMips(imageFile.getFormat()) || destOffset != vk::Offset3D{}))
+      throw std::runtime_error("Mips can not be generated for this image upload");
+    if (!fitsRegion(imageFile))
+      throw std::runtime_error("Image data size exceeds staging region size");
+    if (!fitsImage(imageFile))
       flush();
+    const vk::DeviceSize alignment = getImageOffsetAlignment(imageFile.getFormat());
+    mUsedBytes = alignImageOffset(mUsedBytes, alignment);
     vk::DeviceSize srcOffset = mUsedBytes;
-    imageFile.loadData(mMappedPtr + srcOffset);
-    mUsedBytes += imageDataSize;
+    std::byte* reserved = mMappedPtr + srcOffset;
+    mUsedBytes += getStagedImageSize(imageFile);
 
-    vk::BufferImageCopy copyInfo;
-    copyInfo.bufferOffset = srcOffset;
-    copyInfo.imageExtent = imageFile.getExtent();
-    copyInfo.imageOffset = destOffset;
-    copyInfo.imageSubresource = layers;
-    mStagedImageCopies.push_back({dst, preLayout, postLayout, copyInfo});
+    StagedImageCopy& staged = mStagedImageCopies.emplace_back();
+    staged.dst = dst;
+    staged.preLayout = preLayout;
+    staged.postLayout = postLayout;
+    staged.range = vk::ImageSubresourceRange{layers.aspectMask, layers.mipLevel, imageFile.getMipLevels() + generatedMipLevels, layers.baseArrayLayer,
+                                             imageFile.getArrayLayers()};
+    staged.extent = imageFile.getExtent();
+    staged.generatedMipLevels = generatedMipLevels;
+    staged.useMipQueue = generatedMipLevels > 0;
+    const vk::Extent3D& extent = staged.extent;
+    for (uint32_t layer = 0; layer < imageFile.getArrayLayers(); ++layer) {
+      for (uint32_t mip = 0; mip < imageFile.getMipLevels(); ++mip) {
+        srcOffset = alignImageOffset(srcOffset, alignment);
+        vk::BufferImageCopy& copyInfo = staged.regions.emplace_back();
+        copyInfo.bufferOffset = srcOffset;
+        copyInfo.imageExtent = vw::getMipExtent(extent, mip);
+        copyInfo.imageOffset = vk::Offset3D{destOffset.x >> mip, destOffset.y >> mip, destOffset.z >> mip};
+        copyInfo.imageSubresource = vk::ImageSubresourceLayers{layers.aspectMask, layers.mipLevel + mip, layers.baseArrayLayer + layer, 1};
+        srcOffset += imageFile.getSubresourceSize(mip);
+      }
+    }
+    return reserved;
   }
   vk::DeviceSize remainingSpace() const {
-    return mSegmentSizes[0] - mUsedBytes;
+    return regionEnd() - mUsedBytes;
   }
-  void flush() {
-    auto fence = mTransferQueue.oneTimeRecordSubmit([&](vw::CommandBuffer& cmdBuffer) {
-      for (const auto& copy : mStagedBufferCopies) {
-        cmdBuffer.copyBuffer(mHandle, copy.dst, copy.bufferCopy);
-      }
-      for (const auto& copy : mStagedImageCopies) {
-        const vk::ImageSubresourceLayers& layers = copy.imageCopy.imageSubresource;
-        vk::ImageSubresourceRange range{layers.aspectMask, layers.mipLevel, 1, layers.baseArrayLayer, layers.layerCount};
-        vw::Image::transitionLayout(cmdBuffer, copy.dst, copy.preLayout, vk::ImageLayout::eTransferDstOptimal, range);
-        cmdBuffer.copyBufferToImage(mHandle, copy.dst, vk::ImageLayout::eTransferDstOptimal, copy.imageCopy);
-        vw::Image::transitionLayout(cmdBuffer, copy.dst, vk::ImageLayout::eTransferDstOptimal, copy.postLayout, range);
-      }
-    });
-    fence->wait();
-    mStagedBufferCopies.clear();
-    mStagedImageCopies.clear();
-    mUsedBytes = 0;
+  // Whether the file can be reserved without a flush
+  bool fitsImage(const ImageFile& imageFile) const {
+    return alignImageOffset(mUsedBytes, getImageOffsetAlignment(imageFile.getFormat())) + getStagedImageSize(imageFile) <= regionEnd();
+  }
+  // Whether the file can be staged at once, larger ones are copied in bands
+  bool fitsRegion(const ImageFile& imageFile) const {
+    // Regions start 16 byte aligned, formats with 3, 6 or 12 byte texels may need more
+    return getStagedImageSize(imageFile) + getImageOffsetAlignment(imageFile.getFormat()) - 16 <= mRegionSize;
+  }
+  // Bytes the file takes in the staging buffer, more than dataSize() when subresources need padding to start at an aligned offset
+  static vk::DeviceSize getStagedImageSize(const ImageFile& imageFile);
+  // Writes the file to a range returned by reserveImageCopy. loadData packs the subresources tightly, they are moved apart to their aligned
+  // offsets afterwards
+  static void loadStagedImage(const ImageFile& imageFile, std::byte* dst);
+  // Largest upload that fits at once
+  vk::DeviceSize regionSize() const {
+    return mRegionSize;
   }
+  // Submits the staged copies of the current region without waiting for them and moves on to the next region, which blocks only while that
+  // region's earlier copies are still running
+  void flush();
+  // Blocks until every submitted copy has finished, the destination resources are ready for use on other queues afterwards
+  void wait();
 
  private:
+  vk::DeviceSize regionEnd() const {
+    return mRegion * mRegionSize + mRegionSize;
+  }
+  // Copies from a buffer need offsets that are multiples of 4 and of the texel block size, 16 covers both for all but 3, 6 and 12 byte texels
+  static vk::DeviceSize getImageOffsetAlignment(vk::Format format) {
+    return std::lcm(vk::DeviceSize{16}, vk::DeviceSize{vw::getFormatBlock(format).size});
+  }
+  static vk::DeviceSize alignImageOffset(vk::DeviceSize offset, vk::DeviceSize alignment) {
+    vw::alignTo(offset, alignment);
+    return offset;
+  }
   template <typename T>
   vk::DeviceSize copyToMappedEnd(const T& src) {
     copyToMapped(src, 0, mUsedBytes);
@@ -210,12 +402,68 @@ class StagingBuffer : public vw::Buffer {
     vk::Image dst;
     vk::ImageLayout preLayout;
     vk::ImageLayout postLayout;
-    vk::BufferImageCopy imageCopy;
+    vk::ImageSubresourceRange range;
+    vk::Extent3D extent;
+    uint32_t generatedMipLevels;
+    // Every band of an image with generated mips goes to the mip queue, which keeps them ordered before the blits. Flushes holding bands
+    // hold nothing else, so the bands of one image never end up on different queues
+    bool useMipQueue;
+    std::vector<vk::BufferImageCopy> regions;
   };
+  void queueImageCopyInBands(const ImageFile& imageFile,
+                             vk::Image dst,
+                             vk::ImageLayout preLayout,
+                             vk::ImageLayout postLayout,
+                             vk::ImageSubresourceLayers layers,
+                             vk::Offset3D destOffset,
+                             uint32_t generatedMipLevels);
+  void recordImageCopies(vk::CommandBuffer cmdBuffer) const;
   std::vector<StagedBufferCopy> mStagedBufferCopies;
   std::vector<StagedImageCopy> mStagedImageCopies;
+  // Write position in the whole buffer, always inside the current region
   vk::DeviceSize mUsedBytes = 0;
   vw::Queue& mTransferQueue;
+  vw::Queue* mMipQueue;
+  vk::DeviceSize mRegionSize;
+  uint32_t mRegion = 0;
+  // Last submission that read from each region
+  std::vector<std::shared_ptr<vw::Fence>> mRegionFences;
+};
+
+// Bump allocator for transient per-frame data over a persistently mapped buffer with one slot per frame in flight. Allocations are addressed
+// through dynamic offsets into getDescriptorInfo, and a slot is only handed out again once the fence of the frame that last filled it signaled
+class FrameAllocator : public vw::Buffer {
+ public:
+  FrameAllocator(MemoryAllocator& allocator,
+                 vk::DeviceSize frameSize,
+                 uint32_t frameCount,
+                 vk::BufferUsageFlags usage = vw::BufferUse::kUniformBuffer | vw::BufferUse::kStorageBuffer);
+  struct Allocation {
+    std::byte* data;
+    uint32_t dynamicOffset;
+  };
+  // Moves to the next slot and empties it, waiting for the frame that used it last
+  void beginFrame();
+  // The submission reading the allocations of this frame
+  void endFrame(std::shared_ptr<vw::Fence> fence);
+  // size bytes at an offset valid for dynamic uniform and storage buffer descriptors
+  Allocation allocate(vk::DeviceSize size);
+  template <typename T>
+  uint32_t push(const T& src) {
+    Allocation allocation = allocate(vw::byteSize(src));
+    std::memcpy(allocation.data, std::data(src), vw::byteSize(src));
+    return allocation.dynamicOffset;
+  }
+  // Dynamic descriptors start at the beginning of the buffer and cover range bytes past every dynamic offset
+  vk::DescriptorBufferInfo getDescriptorInfo(vk::DeviceSize range) const {
+    return {mHandle, 0, range};
+  }
+
+ private:
+  vk::DeviceSize mOffsetAlignment;
+  uint32_t mFrame = 0;
+  vk::DeviceSize mUsedBytes = 0;
+  std::vector<std::shared_ptr<vw::Fence>> mFrameFences;
 };
 
 };  // namespace vw
\ No newline at end of file
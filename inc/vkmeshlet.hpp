@@ -0,0 +1,38 @@
+#pragma once
+#include <vector>
+#include "vkutils.hpp"
+#include "vkvertex.hpp"
+
+namespace vw {
+
+constexpr uint32_t kMaxMeshletVertices = 64;
+constexpr uint32_t kMaxMeshletTriangles = 124;
+
+// std430 layout, bounds are in the mesh's model space
+struct Meshlet {
+  Vec3 center{0.0f};
+  float radius = 0.0f;
+  // Backface culling cone, the meshlet is invisible from cameraPos if dot(normalize(coneApex - cameraPos), coneAxis) >= coneCutoff
+  Vec3 coneApex{0.0f};
+  float coneCutoff = 1.0f;
+  Vec3 coneAxis{0.0f};
+  // Into the meshlet vertex array, which holds mesh-relative vertex indices
+  uint32_t vertexOffset = 0;
+  // Into the meshlet triangle array, which holds three meshlet-relative uint8_t indices per triangle
+  uint32_t triangleOffset = 0;
+  uint32_t vertexCount = 0;
+  uint32_t triangleCount = 0;
+  uint32_t _pad = 0;
+};
+static_assert(sizeof(Meshlet) == 64);
+
+struct MeshletData {
+  std::vector<Meshlet> meshlets;
+  std::vector<uint32_t> vertices;
+  std::vector<uint8_t> triangles;
+};
+
+// Greedily splits the triangles of one mesh into meshlets in index order, so cache-optimized input yields spatially coherent meshlets
+void buildMeshlets(ArrayProxy<uint32_t> indices, ArrayProxy<Vec3> positions, MeshletData& meshletData);
+
+}  // namespace vw
@@ -0,0 +1,42 @@
+#pragma once
+#include <vector>
+#include "vkutils.hpp"
+#include "vkvertex.hpp"
+
+// Index and vertex reordering for a single triangle list, indices are relative to the mesh's first vertex
+namespace vw {
+
+// FIFO size used when simulating the post-transform cache for the metrics
+constexpr uint32_t kVertexCacheAnalysisSize = 16;
+
+struct VertexCacheStats {
+  // Transformed vertices per triangle, 0.5 is the lower bound for a regular grid and 3 means no reuse
+  float acmr = 0.0f;
+  // Transformed vertices per referenced vertex, 1 is optimal
+  float atvr = 0.0f;
+};
+
+// Shaded fragments per covered pixel averaged over six axis-aligned views, 1 is optimal
+struct OverdrawStats {
+  float overdraw = 0.0f;
+};
+
+// Reorders triangles for post-transform cache reuse (Forsyth's linear-speed vertex cache optimization)
+void optimizeVertexCache(std::vector<uint32_t>& indices, uint32_t vertexCount);
+// Splits the cache-optimized order into clusters and sorts them outward-facing first, threshold bounds the ACMR loss relative to the input order
+void optimizeOverdraw(std::vector<uint32_t>& indices, ArrayProxy<Vec3> positions, float threshold = 1.05f);
+// Renumbers vertices in first-use order so vertex fetch walks memory linearly and rewrites indices to match, unreferenced vertices are moved
+// to the end. Returns the table mapping old to new vertex indices, to be applied to every attribute with remapVertices
+std::vector<uint32_t> optimizeVertexFetch(std::vector<uint32_t>& indices, uint32_t vertexCount);
+
+template <typename T>
+void remapVertices(T* vertices, ArrayProxy<uint32_t> remap) {
+  std::vector<T> source(vertices, vertices + remap.size());
+  for (uint32_t i = 0; i < remap.size(); ++i)
+    vertices[remap[i]] = source[i];
+}
+
+VertexCacheStats analyzeVertexCache(ArrayProxy<uint32_t> indices, uint32_t vertexCount, uint32_t cacheSize = kVertexCacheAnalysisSize);
+OverdrawStats analyzeOverdraw(ArrayProxy<uint32_t> indices, ArrayProxy<Vec3> positions);
+
+}  // namespace vw
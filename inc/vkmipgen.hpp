@@ -0,0 +1,14 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace vw {
+
+// Box filters each level into the next one down to 1x1, the extent of level i is max(1, extent >> i) as Vulkan expects.
+// base holds width x height tightly packed texels of channelCount (1, 2 or 4) 8-bit channels. Writes levels 1..n back to back to dst, which
+// needs getMipChainSize bytes. dst is only written, never read, so it can be write combined staging memory.
+// With srgb the color channels are averaged in linear space, the last channel of grey-alpha and RGBA images is alpha and always averaged as is
+void generateMipChain(const std::byte* base, uint32_t width, uint32_t height, uint32_t channelCount, bool srgb, std::byte* dst);
+size_t getMipChainSize(uint32_t width, uint32_t height, uint32_t channelCount);
+
+}  // namespace vw
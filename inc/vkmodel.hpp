@@ -1,16 +1,14 @@
 #pragma once
 #include <filesystem>
 #include <glm/mat4x4.hpp>
-#include <glm/vec2.hpp>
-#include <glm/vec3.hpp>
 #include <vector>
 #include <vulkan/vulkan.hpp>
 #include "vkmemory.hpp"
+#include "vkmeshlet.hpp"
 #include "vktexture.hpp"
+#include "vkvertex.hpp"
 
 namespace vw {
-using Vec2 = glm::vec2;
-using Vec3 = glm::vec3;
 using AABB = std::array<Vec3, 8>;
 enum TextureType { Diffuse, Normals, Specular, MaxEnum };
 
@@ -18,46 +16,123 @@ struct MaterialFiles {
   std::unordered_map<TextureType, std::filesystem::path> textures;
 };
 
-static constexpr std::array<vk::VertexInputBindingDescription, 4> kInputBindings{
-    vk::VertexInputBindingDescription{0, sizeof(vw::Vec3)}, vk::VertexInputBindingDescription{1, sizeof(vw::Vec3)},
-    vk::VertexInputBindingDescription{2, sizeof(vw::Vec3)}, vk::VertexInputBindingDescription{3, sizeof(vw::Vec3)}};
+constexpr uint32_t kMaxLodCount = 8;
 
-static constexpr std::array<vk::VertexInputAttributeDescription, 4> kInputAttributes{
-    vk::VertexInputAttributeDescription{0, 0, vk::Format::eR32G32B32Sfloat, 0}, vk::VertexInputAttributeDescription{1, 1, vk::Format::eR32G32B32Sfloat, 0},
-    vk::VertexInputAttributeDescription{2, 2, vk::Format::eR32G32B32Sfloat, 0}, vk::VertexInputAttributeDescription{3, 3, vk::Format::eR32G32B32Sfloat, 0}};
+// One level of detail of a mesh, indexes the mesh's vertices from the mesh's index region
+struct MeshLod {
+  uint32_t indexCount = 0;
+  uint32_t firstIndex = 0;
+  // Model-space simplification error relative to the full resolution mesh
+  float error = 0.0f;
+};
 
+// indexCount/firstIndex describe the full resolution mesh, which is also the first of its LODs
 struct MeshInfo {
   uint32_t indexCount = 0;
+  // Relative to the start of the index region of indexType
   uint32_t firstIndex = 0;
   uint32_t vertexOffset = 0;
   uint32_t materialIndex = 0;
+  uint32_t vertexCount = 0;
+  uint32_t instanceCount = 0;
+  vk::IndexType indexType = vk::IndexType::eUint32;
+  // Range in Scene::meshlets(), empty unless SceneOptions::generateMeshlets is set
+  uint32_t firstMeshlet = 0;
+  uint32_t meshletCount = 0;
+  // Range in Scene::lods()
+  uint32_t firstLod = 0;
+  uint32_t lodCount = 1;
+  // Model-space bounding sphere
+  Vec3 boundsCenter{0.0f};
+  float boundsRadius = 0.0f;
 };
 
-class Material {
- public:
-  Material(vw::MemoryAllocator& allocator, const MaterialFiles& files);
-  Material(const Material& other) = delete;
-  Material& operator=(const Material& other) = delete;
-  void queueCopies(vw::StagingBuffer& stagingBuffer);
-  std::array<vk::DescriptorImageInfo, 3> getTextureDescriptorInfos(vk::Sampler sampler) const;
+// Per-instance vertex attribute read by offscreen.vert at location kVertexAttributeCount
+struct InstanceData {
+  uint32_t modelMatrixIdx = 0;
+  uint32_t meshIdx = 0;
+};
 
- private:
-  struct Texture {
-    std::optional<std::unique_ptr<vw::ImageFile>> imageFile;
-    std::optional<vw::Image> image;
-    std::optional<vw::ImageView> imageView;
-  };
-  std::array<Texture, vw::TextureType::MaxEnum> mTextures;
+// std430 layout of the per-mesh data read by offscreen.vert
+struct PerMeshData {
+  Vec3 positionOffset{0.0f};
+  uint32_t materialIdx = 0;
+  Vec3 positionScale{1.0f};
+  uint32_t modelMatrixBaseIndex = 0;
+};
+static_assert(sizeof(PerMeshData) == 32);
+
+struct SceneOptions {
+  // Worker threads decoding material textures during import, 0 uses one per hardware thread and 1 decodes serially
+  uint32_t textureDecodeThreads = 0;
+  VertexFormat vertexFormat = VertexFormat::Float;
+  VertexLayout vertexLayout = VertexLayout::Separate;
+  // Vertex cache, overdraw and vertex fetch reordering of every mesh, printMeshStats reports the metrics before and after (cache misses only)
+  bool optimizeMeshes = true;
+  bool printMeshStats = false;
+  // Splits every mesh into meshlets of at most kMaxMeshletVertices/kMaxMeshletTriangles with bounding spheres and normal cones for culling
+  bool generateMeshlets = false;
+  // Levels of detail per mesh including the full resolution one, each simplified to about half the triangles of the previous (at most kMaxLodCount)
+  uint32_t lodCount = 1;
+  // Copies of the per-frame draw data, one per frame that can be in flight
+  uint32_t frameSlotCount = 1;
+  // Block compresses non-DDS material textures (BC1/BC3 for color, BC5 for normal maps), encoded once into .vwtex files in textureCacheDirectory
+  bool compressTextures = true;
+  // See TextureDecodeOptions::cacheDirectory, the model directory may well be read-only
+  std::filesystem::path textureCacheDirectory = "texture_cache";
+  // Writes vertex, index and meshlet data directly into DEVICE_LOCAL | HOST_VISIBLE buffers when the device has such memory within budget,
+  // the per-frame and per-mesh data is host-visible already
+  bool directUpload = true;
+  // Reads and writes the baked scene in a .vwcache file next to the model, without it every import runs Assimp and the mesh passes
+  bool sceneCache = true;
 };
 
+struct LodSelection {
+  Vec3 cameraPos{0.0f};
+  // Pixels covered by one world unit at distance one, viewportHeight * 0.5 * |proj[1][1]| for a perspective projection
+  float pixelsPerUnit = 0.0f;
+  // Every instance gets the coarsest LOD whose error projects to at most this many pixels
+  float maxPixelError = 1.0f;
+};
+
+// Texture registry indices of a material, matches the uvec4 per material read by offscreen.vert
+struct Material {
+  std::array<uint32_t, vw::TextureType::MaxEnum> textureIndices;
+  uint32_t _pad = 0;
+};
+static_assert(sizeof(Material) == 4 * sizeof(uint32_t));
+
 class Scene {
  public:
-  Scene(vw::MemoryAllocator& allocator, vw::StagingBuffer& stagingBuf, const std::filesystem::path& modelPath);
+  // Loads from "<modelPath>.vwcache" when it was baked from the same model file and import settings, otherwise imports with Assimp and bakes it
+  Scene(vw::MemoryAllocator& allocator, vw::StagingBuffer& stagingBuf, const std::filesystem::path& modelPath, const SceneOptions& options = {});
   const std::vector<MeshInfo>& meshes() const {
     return mMeshes;
   }
-  const FixedVec<Material>& materials() const {
-    return mMaterials.value();
+  const std::vector<MeshLod>& lods() const {
+    return mLods;
+  }
+  const std::vector<Meshlet>& meshlets() const {
+    return mMeshlets;
+  }
+  // Segments 0-2 hold the meshlets, their vertex indices and their uint8_t triangle indices, std::nullopt without meshlets
+  const std::optional<vw::Buffer>& meshletBuffer() const {
+    return mMeshletBuffer;
+  }
+  const VertexInputDescription& vertexInput() const {
+    return mVertexInput;
+  }
+  VertexFormat vertexFormat() const {
+    return mVertexFormat;
+  }
+  const std::vector<Material>& materials() const {
+    return mMaterials;
+  }
+  uint32_t textureCount() const {
+    return mTextures.size();
+  }
+  std::vector<vk::DescriptorImageInfo> textureDescriptorInfos(vk::Sampler sampler) const {
+    return mTextures.getDescriptorInfos(sampler);
   }
   const vk::DescriptorBufferInfo& perMeshShaderDataDesc() const {
     return mPerMeshShaderDataDesc;
@@ -65,22 +140,61 @@ class Scene {
   const vk::DescriptorBufferInfo& modelMatrixArrayDesc() const {
     return mModelMatrixArrayDesc;
   }
-  void draw(vk::CommandBuffer cmdBuf) const {
-    uint32_t vboSectionSize = mTotalVertexCount * sizeof(vw::Vec3);
-    cmdBuf.bindVertexBuffers(0, {*mVbo, *mVbo, *mVbo, *mVbo}, {0, vboSectionSize, 2 * vboSectionSize, 3 * vboSectionSize});
-    cmdBuf.bindIndexBuffer(*mIbo, 0, vk::IndexType::eUint32);
-    cmdBuf.drawIndexedIndirect(*mIndirectBuffer, 0, mMeshes.size(), sizeof(vk::DrawIndexedIndirectCommand));
+  const vk::DescriptorBufferInfo& materialArrayDesc() const {
+    return mMaterialArrayDesc;
+  }
+  // Registers the static geometry and the textures, the vertex and index buffers pick up moves by themselves, descriptor sets have to be
+  // written again, see Defragmenter
+  void addMovable(vw::Defragmenter& defragmenter);
+  // Picks a LOD for every instance and rewrites the draw commands and instance stream of frameSlot, which the GPU must be done reading
+  void selectLods(uint32_t frameSlot, const LodSelection& selection);
+  void draw(vk::CommandBuffer cmdBuf, uint32_t frameSlot = 0) const {
+    cmdBuf.bindVertexBuffers(0, mVertexBuffers, mVertexStreamOffsets);
+    cmdBuf.bindVertexBuffers(mInstanceBinding, mInstanceBuffer->getHandle(), mInstanceBuffer->getSegmentDesc(frameSlot).offset);
+    vk::DeviceSize slotOffset = mIndirectBuffer->getSegmentDesc(frameSlot).offset;
+    for (size_t i = 0; i < mDrawStreams.size(); ++i) {
+      const DrawStream& stream = mDrawStreams[i];
+      uint32_t drawCount = mSlotDrawCounts[frameSlot][i];
+      if (drawCount == 0)
+        continue;
+      cmdBuf.bindIndexBuffer(*mIbo, stream.indexOffset, stream.indexType);
+      cmdBuf.drawIndexedIndirect(*mIndirectBuffer, slotOffset + stream.commandOffset, drawCount, sizeof(vk::DrawIndexedIndirectCommand));
+    }
   }
 
  private:
-  struct PerMeshData {
-    uint32_t materialIdx, modelMatrixBaseIndex;
+  // Draw commands of the meshes sharing an index type, at commandOffset in every frame slot of the indirect buffer
+  struct DrawStream {
+    vk::IndexType indexType = vk::IndexType::eUint32;
+    vk::DeviceSize indexOffset = 0;
+    vk::DeviceSize commandOffset = 0;
+    uint32_t maxDrawCount = 0;
   };
-
-  std::optional<vw::Buffer> mVbo, mIbo, mIndirectBuffer, mUbo;
+  struct InstanceBounds {
+    Vec3 center{0.0f};
+    float radius = 0.0f;
+    // Largest axis scale of the model matrix, converts model-space LOD errors to world space
+    float scale = 1.0f;
+  };
+  void writeFrameSlot(uint32_t frameSlot);
+  std::optional<vw::Buffer> mVbo, mIbo, mIndirectBuffer, mInstanceBuffer, mUbo, mMeshletBuffer;
   std::vector<MeshInfo> mMeshes;
-  std::optional<vw::FixedVec<Material>> mMaterials;
-  vk::DescriptorBufferInfo mPerMeshShaderDataDesc, mModelMatrixArrayDesc;
+  std::vector<MeshLod> mLods;
+  std::array<DrawStream, 2> mDrawStreams;
+  std::vector<std::array<uint32_t, 2>> mSlotDrawCounts;
+  uint32_t mInstanceBinding = 0;
+  // Indexed by model matrix, the instances of mesh i are modelMatrixBaseIndex + [0, instanceCount)
+  std::vector<uint32_t> mMeshInstanceBase;
+  std::vector<InstanceBounds> mInstanceBounds;
+  std::vector<uint8_t> mInstanceLods;
+  std::vector<Meshlet> mMeshlets;
+  VertexFormat mVertexFormat;
+  VertexInputDescription mVertexInput;
+  std::vector<vk::Buffer> mVertexBuffers;
+  std::vector<vk::DeviceSize> mVertexStreamOffsets;
+  std::vector<Material> mMaterials;
+  vw::TextureRegistry mTextures;
+  vk::DescriptorBufferInfo mPerMeshShaderDataDesc, mModelMatrixArrayDesc, mMaterialArrayDesc;
   uint32_t mTotalVertexCount = 0, mTotalIndexCount = 0, mTotalInstanceCount = 0;
 };
 }  // namespace vw
\ No newline at end of file
@@ -76,8 +76,9 @@ class GraphicsPipelineBuilder {
  public:
   GraphicsPipelineBuilder(vk::PipelineLayout layout, vk::RenderPass renderpass, uint32_t subpassIndex = 0)
       : mLayoutHandle{layout}, mRenderPassHandle{renderpass}, mSubpassIndex{subpassIndex} {}
-  inline void addShaderStage(vk::ShaderStageFlagBits stage, vk::ShaderModule module) {
-    mShaderStages.push_back(vk::PipelineShaderStageCreateInfo{{}, stage, module, "main"});
+  // specializationInfo has to stay alive until the pipeline is created
+  inline void addShaderStage(vk::ShaderStageFlagBits stage, vk::ShaderModule module, const vk::SpecializationInfo* specializationInfo = nullptr) {
+    mShaderStages.push_back(vk::PipelineShaderStageCreateInfo{{}, stage, module, "main", specializationInfo});
   }
   inline void setVertexInputState(ArrayProxy<vk::VertexInputBindingDescription> inputBindingDescriptions,
                                   ArrayProxy<vk::VertexInputAttributeDescription> inputAttributeDescriptions) {
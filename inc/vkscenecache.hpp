@@ -0,0 +1,94 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include "vkfile.hpp"
+#include "vkutils.hpp"
+
+namespace vw {
+
+// Bump whenever the section set or the layout of any section changes
+constexpr uint32_t kSceneCacheVersion = 5;
+
+enum class SceneCacheSection : uint32_t {
+  // Encoded vertex data, one section per vertex binding
+  VertexStream0,
+  VertexStream1,
+  VertexStream2,
+  VertexStream3,
+  Indices16,
+  Indices32,
+  Meshes,
+  MeshLods,
+  PerMeshData,
+  ModelMatrices,
+  MaterialPaths,
+  Meshlets,
+  MeshletVertices,
+  MeshletTriangles,
+  MaxEnum
+};
+
+// Identifies the source file and import settings a cache was baked from, any mismatch invalidates the cache
+struct SceneCacheKey {
+  uint64_t sourceSize = 0;
+  int64_t sourceWriteTime = 0;
+  uint32_t importFlags = 0;
+  uint32_t importOptions = 0;
+  static SceneCacheKey fromSource(const std::filesystem::path& sourcePath, uint32_t importFlags, uint32_t importOptions);
+  bool operator==(const SceneCacheKey& other) const {
+    return sourceSize == other.sourceSize && sourceWriteTime == other.sourceWriteTime && importFlags == other.importFlags &&
+           importOptions == other.importOptions;
+  }
+};
+
+namespace detail {
+struct SceneCacheSectionEntry {
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+struct SceneCacheHeader {
+  static constexpr uint32_t kMagic = 0x43535756;  // "VWSC"
+  uint32_t magic = kMagic;
+  uint32_t version = kSceneCacheVersion;
+  SceneCacheKey key;
+  std::array<SceneCacheSectionEntry, static_cast<size_t>(SceneCacheSection::MaxEnum)> sections;
+};
+}  // namespace detail
+
+class SceneCacheWriter {
+ public:
+  template <typename T>
+  void addSection(SceneCacheSection section, const T& container) {
+    mSections[static_cast<size_t>(section)] = {reinterpret_cast<const std::byte*>(container.data()), vw::byteSize(container)};
+  }
+  // Writes to a temporary file first so an interrupted write never leaves a valid-looking cache behind
+  void write(const std::filesystem::path& path, const SceneCacheKey& key) const;
+
+ private:
+  struct PendingSection {
+    const std::byte* data = nullptr;
+    uint64_t size = 0;
+  };
+  std::array<PendingSection, static_cast<size_t>(SceneCacheSection::MaxEnum)> mSections;
+};
+
+class SceneCacheReader {
+ public:
+  // Returns an empty optional if the cache is missing, corrupt or was baked from a different source/import settings
+  static std::optional<SceneCacheReader> open(const std::filesystem::path& path, const SceneCacheKey& key);
+  template <typename T>
+  vw::ArrayProxy<T> get(SceneCacheSection section) const {
+    const auto& entry = mHeader.sections[static_cast<size_t>(section)];
+    return {reinterpret_cast<const T*>(mFile.data() + entry.offset), static_cast<uint32_t>(entry.size / sizeof(T))};
+  }
+
+ private:
+  SceneCacheReader(vw::MappedFile&& file, const detail::SceneCacheHeader& header) : mFile{std::move(file)}, mHeader{header} {}
+  vw::MappedFile mFile;
+  detail::SceneCacheHeader mHeader;
+};
+
+}  // namespace vw
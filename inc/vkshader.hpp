@@ -1,6 +1,7 @@
 #pragma once
 #include <filesystem>
 #include <string>
+#include "vkfile.hpp"
 #include "vkutils.hpp"
 #include "vulkan/vulkan.hpp"
 
@@ -15,11 +16,13 @@ struct ShaderIOBinding {
   bool isVariable;
 };
 
-std::vector<uint32_t> loadShader(std::filesystem::path path);
+// SPIR-V is consumed in place from the mapping, which is page aligned as vkCreateShaderModule requires
+vw::MappedFile loadShader(std::filesystem::path path);
 
 class Shader : public vw::HandleContainerUnique<vk::ShaderModule> {
  public:
   Shader(vk::ShaderStageFlagBits stage, vw::ArrayProxy<uint32_t> binary, vw::ArrayProxy<ShaderIOBinding> ioBindings, uint32_t pushConstantSize = 0);
+  Shader(vk::ShaderStageFlagBits stage, const vw::MappedFile& binary, vw::ArrayProxy<ShaderIOBinding> ioBindings, uint32_t pushConstantSize = 0);
   const std::vector<ShaderIOBinding>& getIOBindings() const {
     return mIOBindings;
   }
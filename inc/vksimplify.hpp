@@ -0,0 +1,13 @@
+#pragma once
+#include <vector>
+#include "vkutils.hpp"
+#include "vkvertex.hpp"
+
+namespace vw {
+
+// Quadric error metric edge collapse that only rewrites indices: vertices are collapsed onto existing neighbours, so every simplified level
+// shares the source vertex buffer. Vertices on open borders and attribute seams stay in place. Stops at targetIndexCount or when the next
+// collapse would exceed maxError, error receives the largest error introduced (a model-space distance)
+std::vector<uint32_t> simplifyMesh(ArrayProxy<uint32_t> indices, ArrayProxy<Vec3> positions, uint32_t targetIndexCount, float maxError, float& error);
+
+}  // namespace vw
@@ -0,0 +1,9 @@
+#pragma once
+#include <cstddef>
+
+namespace vw {
+
+// Largest resident set size the process has reached so far in bytes, includes mapped file pages that were read
+size_t getPeakResidentBytes();
+
+}  // namespace vw
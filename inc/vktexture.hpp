@@ -1,41 +1,114 @@
 #pragma once
+#include <array>
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
 #include <vulkan/vulkan.hpp>
+#include "vkfile.hpp"
+#include "vkmemory.hpp"
+#include "vkthreadpool.hpp"
 #include "vkutils.hpp"
 
 namespace vw {
 
+// Swizzles that sample grey and grey-alpha images as RGBA
+constexpr vk::ComponentMapping kGreyComponentMapping{vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eOne};
+constexpr vk::ComponentMapping kGreyAlphaComponentMapping{vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eR,
+                                                          vk::ComponentSwizzle::eG};
+
+// Decodes with stb_image into R8, R8G8 (grey and alpha) or R8G8B8A8, requiredCompCount = 0 keeps the file's channels with RGB padded to RGBA.
+// generateMips appends the box filtered chain below the decoded level. The constructor only reads the header, loadData decodes straight into
+// the destination and frees the decoded pixels again, so no file holds its texels between decode and upload
 class GenericImageFile : public ImageFile {
  public:
-  using value_type = std::byte;
-  GenericImageFile(const std::filesystem::path& path, int requiredCompCount = 4);
-  ~GenericImageFile();
+  GenericImageFile(const std::filesystem::path& path, int requiredCompCount = 0, bool generateMips = false, bool srgb = false);
   vk::Extent3D getExtent() const override {
     return mExtent;
   }
   vk::Format getFormat() const override {
-    return vk::Format::eR8G8B8A8Unorm;
+    switch (mComponentCount) {
+      case 1:
+        return vk::Format::eR8Unorm;
+      case 2:
+        return vk::Format::eR8G8Unorm;
+      default:
+        return vk::Format::eR8G8B8A8Unorm;
+    }
+  }
+  vk::ComponentMapping getComponentMapping() const override {
+    switch (mComponentCount) {
+      case 1:
+        return kGreyComponentMapping;
+      case 2:
+        return kGreyAlphaComponentMapping;
+      default:
+        return {};
+    }
+  }
+  uint32_t getComponentCount() const {
+    return mComponentCount;
+  }
+  uint32_t getMipLevels() const override {
+    return mMipLevels;
   }
   vk::DeviceSize dataSize() const override {
-    return mSize;
+    return getSubresourcesSize();
   }
-  void loadData(std::byte* dest) const override {
-    std::copy(mDataStart, mDataStart + mSize, dest);
+  // Safe to call from several threads at once, each call decodes the file again
+  void loadData(std::byte* dest) const override;
+
+ private:
+  std::filesystem::path mPath;
+  vw::MappedFile mFile;
+  vk::Extent3D mExtent;
+  uint32_t mMipLevels = 1;
+  uint32_t mComponentCount = 4;
+  bool mSrgb = false;
+};
+
+// Block compressed mip chain, either mapped from a texture cache file or freshly encoded
+class CompressedImageFile : public ImageFile {
+ public:
+  CompressedImageFile(vk::Format format, vk::Extent3D extent, uint32_t mipLevels, std::vector<std::byte> data)
+      : mFormat{format}, mExtent{extent}, mMipLevels{mipLevels}, mEncoded{std::move(data)}, mData{mEncoded.data()}, mSize{mEncoded.size()} {}
+  CompressedImageFile(vk::Format format, vk::Extent3D extent, uint32_t mipLevels, vw::MappedFile file, size_t dataOffset)
+      : mFormat{format}, mExtent{extent}, mMipLevels{mipLevels}, mFile{std::move(file)}, mData{mFile->data() + dataOffset}, mSize{mFile->size() - dataOffset} {}
+  vk::Extent3D getExtent() const override {
+    return mExtent;
   }
-  std::byte* begin() const {
-    return mDataStart;
+  vk::Format getFormat() const override {
+    return mFormat;
   }
-  inline std::byte* end() const {
-    return mDataStart + mSize;
+  uint32_t getMipLevels() const override {
+    return mMipLevels;
   }
-  inline vk::DeviceSize size() const {
+  // BC4 is only produced for grey textures
+  vk::ComponentMapping getComponentMapping() const override {
+    return (mFormat == vk::Format::eBc4UnormBlock) ? kGreyComponentMapping : vk::ComponentMapping{};
+  }
+  vk::DeviceSize dataSize() const override {
     return mSize;
   }
+  void loadData(std::byte* dest) const override {
+    std::copy(mData, mData + mSize, dest);
+  }
+  bool hasRangedLoad() const override {
+    return true;
+  }
+  void loadRange(vk::DeviceSize offset, vk::DeviceSize size, std::byte* dest) const override {
+    std::copy(mData + offset, mData + offset + size, dest);
+  }
 
  private:
-  std::byte* mDataStart = nullptr;
-  vk::DeviceSize mSize;
+  vk::Format mFormat;
   vk::Extent3D mExtent;
+  uint32_t mMipLevels;
+  std::vector<std::byte> mEncoded;
+  std::optional<vw::MappedFile> mFile;
+  const std::byte* mData;
+  size_t mSize;
 };
 
 template <typename T>
@@ -60,6 +133,83 @@ class DefaultValueFile : public ImageFile {
   vk::Format mFormat;
 };
 
+// 1x1 fallback textures, each is created at most once per registry and shared by all materials missing that map
+enum class DefaultTexture { Black, FlatNormal, Specular, MaxEnum };
+
+// Only applies to files that come without mips. Gpu blits them at upload time, linearly filtered in the image's format, and falls back to a
+// single level for formats that can not be blitted
+enum class MipGeneration { None, Cpu, Gpu };
+
+// Color picks BC1, or BC3 when any texel is not fully opaque. Normal keeps XY in BC5, the shaders rebuild Z
+enum class TextureCompression { None, Color, Normal };
+
+struct TextureDecodeOptions {
+  // 0 keeps the channels of the file, see GenericImageFile
+  int componentCount = 0;
+  MipGeneration mipGeneration = MipGeneration::Gpu;
+  // Color channels hold sRGB encoded values, Cpu mips are filtered in linear space
+  bool srgb = false;
+  // Applies to non-DDS files, which then always get Cpu mips. The encoded chain is cached in a .vwtex file in cacheDirectory
+  TextureCompression compression = TextureCompression::None;
+  // Created on first write, relative paths resolve against the working directory and an empty path disables the cache
+  std::filesystem::path cacheDirectory = "texture_cache";
+};
+
+// Picks the decoder from the file extension
+std::unique_ptr<vw::ImageFile> loadImageFile(const std::filesystem::path& path, const TextureDecodeOptions& options = {});
+
+// Owns the GPU images of a scene, every unique (file, decode options) pair is decoded, allocated and uploaded once
+class TextureRegistry {
+ public:
+  // Returns the texture index of the file, registering it on first use
+  uint32_t add(const std::filesystem::path& path, const TextureDecodeOptions& options = {});
+  // Registers an already loaded image that is never shared with other add() calls
+  uint32_t add(std::unique_ptr<vw::ImageFile> imageFile);
+  uint32_t getDefault(DefaultTexture type);
+  // Opens all registered files on the pool, then creates the images in registration order and decodes each file into its staging range on the
+  // pool. The data is written when this returns, the copies are submitted by the next flush. No CPU copy of the textures is kept afterwards
+  void load(vw::MemoryAllocator& allocator, vw::StagingBuffer& stagingBuffer, vw::ThreadPool& decodePool);
+  uint32_t size() const {
+    return vw::size32(mEntries);
+  }
+  std::vector<vk::DescriptorImageInfo> getDescriptorInfos(vk::Sampler sampler) const;
+  // Lets the defragmenter move the loaded images, their views are created again after every move
+  void addMovable(vw::Defragmenter& defragmenter);
+
+ private:
+  struct Entry {
+    std::filesystem::path path;
+    TextureDecodeOptions options;
+    std::unique_ptr<vw::ImageFile> imageFile;
+  };
+  struct GpuTexture {
+    GpuTexture(vw::MemoryAllocator& allocator, const vw::ImageFile& imageFile, uint32_t mipLevels)
+        : image{allocator,
+                imageFile.getFormat(),
+                imageFile.getExtent(),
+                vw::ImageUse::kTexture | vk::ImageUsageFlagBits::eTransferSrc,
+                vk::SampleCountFlagBits::e1,
+                vk::ImageType::e2D,
+                mipLevels,
+                imageFile.getArrayLayers()},
+          viewRange{vk::ImageAspectFlagBits::eColor, 0, mipLevels, 0, 1},
+          components{imageFile.getComponentMapping()},
+          view{createView()} {}
+    // The scene samples every texture through sampler2D, so files with several layers (DDS arrays, cubemaps) only show their first one
+    vw::ImageView createView() const {
+      return image.createView(vk::ImageViewType::e2D, viewRange, components);
+    }
+    vw::Image image;
+    vk::ImageSubresourceRange viewRange;
+    vk::ComponentMapping components;
+    vw::ImageView view;
+  };
+  std::vector<Entry> mEntries;
+  std::unordered_map<std::string, uint32_t> mIndexByKey;
+  std::array<std::optional<uint32_t>, static_cast<size_t>(DefaultTexture::MaxEnum)> mDefaults;
+  std::optional<vw::FixedVec<GpuTexture>> mGpuTextures;
+};
+
 class Sampler : public vw::HandleContainerUnique<vk::Sampler> {
  public:
   Sampler(vk::Filter filter = vk::Filter::eLinear, vk::SamplerAddressMode addressMode = vk::SamplerAddressMode::eRepeat, float maxAnisotropy = 4.0f);
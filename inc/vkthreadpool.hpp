@@ -0,0 +1,46 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace vw {
+
+class ThreadPool {
+ public:
+  // threadCount = 0 spawns one worker per hardware thread
+  ThreadPool(uint32_t threadCount = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool& other) = delete;
+  ThreadPool& operator=(const ThreadPool& other) = delete;
+  uint32_t threadCount() const {
+    return static_cast<uint32_t>(mWorkers.size());
+  }
+  template <typename F>
+  std::future<std::invoke_result_t<std::decay_t<F>>> submit(F&& func) {
+    using ResultT = std::invoke_result_t<std::decay_t<F>>;
+    auto task = std::make_shared<std::packaged_task<ResultT()>>(std::forward<F>(func));
+    std::future<ResultT> result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock{mMutex};
+      mTasks.push([task] { (*task)(); });
+    }
+    mTaskAvailable.notify_one();
+    return result;
+  }
+
+ private:
+  void workerLoop();
+  std::vector<std::thread> mWorkers;
+  std::queue<std::function<void()>> mTasks;
+  std::mutex mMutex;
+  std::condition_variable mTaskAvailable;
+  bool mStopping = false;
+};
+
+}  // namespace vw
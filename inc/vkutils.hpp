@@ -1,8 +1,11 @@
 #pragma once
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <optional>
 #include <vulkan/vulkan.hpp>
+#include "vkfile.hpp"
 
 namespace vw {
 
@@ -61,7 +64,11 @@ class FixedVec {
     mEnd = mBegin;
     mCapacity = mBegin + capacity;
   }
+  FixedVec(const FixedVec& other) = delete;
+  FixedVec& operator=(const FixedVec& other) = delete;
   ~FixedVec() {
+    for (T* it = mBegin; it != mEnd; ++it)
+      it->~T();
     dealloc(mBegin);
   }
   T* begin() {
@@ -99,9 +106,9 @@ class FixedVec {
   }
   template <typename... Args>
   T& emplace_back(Args&&... args) {
-    new (mEnd) T(std::forward<Args>(args)...);
+    T* element = new (mEnd) T(std::forward<Args>(args)...);
     mEnd++;
-    return *mEnd;
+    return *element;
   }
 
  private:
@@ -197,32 +204,165 @@ class DataFile {
   virtual void loadData(std::byte* dst) const = 0;
 };
 
+// Texel block of a format, block compressed formats store width x height texels in size bytes
+struct FormatBlock {
+  uint32_t width;
+  uint32_t height;
+  uint32_t size;
+};
+
+inline FormatBlock getFormatBlock(vk::Format format) {
+  switch (format) {
+    case vk::Format::eR8Unorm:
+    case vk::Format::eR8Snorm:
+    case vk::Format::eR8Uint:
+    case vk::Format::eR8Sint:
+    case vk::Format::eR8Srgb:
+      return {1, 1, 1};
+    case vk::Format::eR8G8Unorm:
+    case vk::Format::eR8G8Snorm:
+    case vk::Format::eR8G8Uint:
+    case vk::Format::eR8G8Sint:
+    case vk::Format::eR8G8Srgb:
+    case vk::Format::eR16Unorm:
+    case vk::Format::eR16Snorm:
+    case vk::Format::eR16Uint:
+    case vk::Format::eR16Sint:
+    case vk::Format::eR16Sfloat:
+    case vk::Format::eD16Unorm:
+    case vk::Format::eB5G6R5UnormPack16:
+    case vk::Format::eB5G5R5A1UnormPack16:
+      return {1, 1, 2};
+    case vk::Format::eR8G8B8A8Unorm:
+    case vk::Format::eR8G8B8A8Snorm:
+    case vk::Format::eR8G8B8A8Uint:
+    case vk::Format::eR8G8B8A8Sint:
+    case vk::Format::eR8G8B8A8Srgb:
+    case vk::Format::eB8G8R8A8Unorm:
+    case vk::Format::eB8G8R8A8Srgb:
+    case vk::Format::eA2R10G10B10UnormPack32:
+    case vk::Format::eA2R10G10B10UintPack32:
+    case vk::Format::eB10G11R11UfloatPack32:
+    case vk::Format::eE5B9G9R9UfloatPack32:
+    case vk::Format::eR16G16Unorm:
+    case vk::Format::eR16G16Snorm:
+    case vk::Format::eR16G16Uint:
+    case vk::Format::eR16G16Sint:
+    case vk::Format::eR16G16Sfloat:
+    case vk::Format::eR32Uint:
+    case vk::Format::eR32Sint:
+    case vk::Format::eR32Sfloat:
+    case vk::Format::eD32Sfloat:
+    case vk::Format::eD24UnormS8Uint:
+      return {1, 1, 4};
+    case vk::Format::eG8B8G8R8422Unorm:
+    case vk::Format::eB8G8R8G8422Unorm:
+      return {2, 1, 4};
+    case vk::Format::eR16G16B16A16Unorm:
+    case vk::Format::eR16G16B16A16Snorm:
+    case vk::Format::eR16G16B16A16Uint:
+    case vk::Format::eR16G16B16A16Sint:
+    case vk::Format::eR16G16B16A16Sfloat:
+    case vk::Format::eR32G32Uint:
+    case vk::Format::eR32G32Sint:
+    case vk::Format::eR32G32Sfloat:
+    case vk::Format::eD32SfloatS8Uint:
+      return {1, 1, 8};
+    case vk::Format::eR32G32B32Uint:
+    case vk::Format::eR32G32B32Sint:
+    case vk::Format::eR32G32B32Sfloat:
+      return {1, 1, 12};
+    case vk::Format::eR32G32B32A32Uint:
+    case vk::Format::eR32G32B32A32Sint:
+    case vk::Format::eR32G32B32A32Sfloat:
+      return {1, 1, 16};
+    case vk::Format::eBc1RgbUnormBlock:
+    case vk::Format::eBc1RgbSrgbBlock:
+    case vk::Format::eBc1RgbaUnormBlock:
+    case vk::Format::eBc1RgbaSrgbBlock:
+    case vk::Format::eBc4UnormBlock:
+    case vk::Format::eBc4SnormBlock:
+      return {4, 4, 8};
+    case vk::Format::eBc2UnormBlock:
+    case vk::Format::eBc2SrgbBlock:
+    case vk::Format::eBc3UnormBlock:
+    case vk::Format::eBc3SrgbBlock:
+    case vk::Format::eBc5UnormBlock:
+    case vk::Format::eBc5SnormBlock:
+    case vk::Format::eBc6HUfloatBlock:
+    case vk::Format::eBc6HSfloatBlock:
+    case vk::Format::eBc7UnormBlock:
+    case vk::Format::eBc7SrgbBlock:
+      return {4, 4, 16};
+    default:
+      throw std::runtime_error("Unsupported image format " + vk::to_string(format));
+  }
+}
+
+inline uint32_t getMaxMipLevels(vk::Extent3D extent) {
+  uint32_t levels = 1;
+  for (uint32_t size = std::max({extent.width, extent.height, extent.depth}); size > 1; size >>= 1)
+    ++levels;
+  return levels;
+}
+
+inline vk::Extent3D getMipExtent(vk::Extent3D extent, uint32_t mipLevel) {
+  return {std::max(extent.width >> mipLevel, 1u), std::max(extent.height >> mipLevel, 1u), std::max(extent.depth >> mipLevel, 1u)};
+}
+
 class ImageFile : public DataFile {
  public:
   virtual ~ImageFile() = default;
   virtual vk::Format getFormat() const {
     return vk::Format::eUndefined;
   }
+  // Extent of the base mip level
   virtual vk::Extent3D getExtent() const = 0;
+  virtual uint32_t getMipLevels() const {
+    return 1;
+  }
+  virtual uint32_t getArrayLayers() const {
+    return 1;
+  }
+  // Swizzle of the image views, lets files with fewer channels be sampled like RGBA
+  virtual vk::ComponentMapping getComponentMapping() const {
+    return {};
+  }
+  // Tightly packed size of one layer of a mip level, partial blocks at the edges of small mips count as whole blocks
+  vk::DeviceSize getSubresourceSize(uint32_t mipLevel) const {
+    FormatBlock block = getFormatBlock(getFormat());
+    vk::Extent3D extent = getMipExtent(getExtent(), mipLevel);
+    vk::DeviceSize blocksX = (extent.width + block.width - 1) / block.width;
+    vk::DeviceSize blocksY = (extent.height + block.height - 1) / block.height;
+    return blocksX * blocksY * extent.depth * block.size;
+  }
+  // Files whose data is mapped or already in memory copy any byte range of loadData's output, see loadRange
+  virtual bool hasRangedLoad() const {
+    return false;
+  }
+  // Writes size bytes of what loadData writes, starting at offset
+  virtual void loadRange(vk::DeviceSize offset, vk::DeviceSize size, std::byte* dst) const {
+    (void)offset, (void)size, (void)dst;
+    throw std::runtime_error("Image file can only be loaded as a whole");
+  }
+  // loadData writes the subresources layer by layer, each layer with its mips from largest to smallest
+  vk::DeviceSize getSubresourcesSize() const {
+    vk::DeviceSize layerSize = 0;
+    for (uint32_t mip = 0; mip < getMipLevels(); ++mip)
+      layerSize += getSubresourceSize(mip);
+    return layerSize * getArrayLayers();
+  }
 };
 
 template <typename T>
 std::vector<T> loadBinaryFile(const std::filesystem::path path) {
-  if (!std::filesystem::exists(path))
-    throw std::runtime_error("File " + path.string() + " does not exist!");
-  if (!std::filesystem::is_regular_file(path))
-    throw std::runtime_error("File " + path.string() + " is not a regular file!");
-
-  auto fSize = std::filesystem::file_size(path);
-  if (fSize % sizeof(T) != 0)
+  vw::MappedFile file{path, vw::FileAccess::Sequential};
+  if (file.size() % sizeof(T) != 0)
     throw std::runtime_error("File " + path.string() + " size is not a multiple of sizeof(T) ");
 
-  std::vector<T> dataVec(fSize / sizeof(T));
-  {
-    std::ifstream binaryFile{path, std::ios::binary};
-    if (!binaryFile.read(reinterpret_cast<char*>(dataVec.data()), fSize))
-      throw std::runtime_error("Error reading  file " + path.string());
-  }
+  std::vector<T> dataVec(file.size() / sizeof(T));
+  if (!dataVec.empty())
+    std::memcpy(dataVec.data(), file.data(), file.size());
   return dataVec;
 }
 
@@ -0,0 +1,52 @@
+#pragma once
+#include <array>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+#include "vkutils.hpp"
+
+namespace vw {
+using Vec2 = glm::vec2;
+using Vec3 = glm::vec3;
+
+// Float: fp32 position, normal, tangent and uv streams
+// Compact: unorm16 positions relative to the mesh bounds, octahedral snorm16 normals/tangents and fp16 uvs
+enum class VertexFormat : uint32_t { Float, Compact };
+
+// Separate: one stream per attribute
+// Interleaved: all attributes in a single stream
+// PositionSplit: positions alone in stream 0 (all a depth-only pass has to fetch), the other attributes interleaved in stream 1
+enum class VertexLayout : uint32_t { Separate, Interleaved, PositionSplit };
+
+enum class VertexAttribute : uint32_t { Position, Normal, Tangent, UV, MaxEnum };
+constexpr size_t kVertexAttributeCount = static_cast<size_t>(VertexAttribute::MaxEnum);
+
+struct VertexInputDescription {
+  std::vector<vk::VertexInputBindingDescription> bindings;
+  std::vector<vk::VertexInputAttributeDescription> attributes;
+};
+
+// Maps quantized positions back to model space: pos = quantized * scale + offset
+struct PositionQuantization {
+  Vec3 offset{0.0f};
+  Vec3 scale{1.0f};
+};
+
+vk::Format getAttributeFormat(VertexFormat format, VertexAttribute attribute);
+uint32_t getAttributeSize(VertexFormat format, VertexAttribute attribute);
+uint32_t getAttributeBinding(VertexLayout layout, VertexAttribute attribute);
+// Attribute locations match the VertexAttribute order, binding i is sourced from vertex stream i
+VertexInputDescription getVertexInputDescription(VertexFormat format, VertexLayout layout);
+
+// Identity for VertexFormat::Float, otherwise the mesh bounds
+PositionQuantization computePositionQuantization(VertexFormat format, ArrayProxy<Vec3> positions);
+// Writes every source element in the attribute's vertex format to dst, advancing dst by stride per element
+void encodeAttribute(VertexFormat format,
+                     VertexAttribute attribute,
+                     ArrayProxy<Vec3> src,
+                     const PositionQuantization& quantization,
+                     std::byte* dst,
+                     size_t stride);
+
+}  // namespace vw
@@ -1,17 +1,22 @@
 #version 460
 #extension GL_EXT_nonuniform_qualifier : enable
+layout(constant_id = 0) const bool kCompactVertices = false;
 layout(location = 0) in vec3 inPos;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec3 inTangent;
 layout(location = 3) in vec3 inUV;
+// x: model matrix index, y: mesh index
+layout(location = 4) in uvec2 inInstance;
 layout(location = 0) out vec2 outUV;
-layout(location = 1) out uint outTexOffset;
+layout(location = 1) out uvec3 outTexIndices;
 layout(location = 2) out mat3 outTBN;
 layout(push_constant) uniform PushData {
     mat4 vp;
 } push;
 struct PerMeshData{
+    vec3 positionOffset;
     uint matIdx;
+    vec3 positionScale;
     uint modelMatrixBaseIndex;
 };
 layout(binding = 0) restrict readonly buffer Ubo0 {
@@ -20,18 +25,31 @@ layout(binding = 0) restrict readonly buffer Ubo0 {
 layout(binding = 1) restrict readonly buffer Ubo1 {
     mat4 modelMatrices[];
 } ubo1;
+layout(binding = 2) restrict readonly buffer Ubo2 {
+    uvec4 materialTextures[];
+} ubo2;
 out gl_PerVertex {
         vec4 gl_Position;
 };
 
+vec3 decodeOctahedral(vec2 e) {
+    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-v.z, 0.0);
+    v.xy += vec2(v.x >= 0.0 ? -t : t, v.y >= 0.0 ? -t : t);
+    return normalize(v);
+}
+
 void main() {
-    outTexOffset = ubo0.modelData[gl_DrawID].matIdx * 3;
-    uint modelMatrixIdx = ubo0.modelData[gl_DrawID].modelMatrixBaseIndex + gl_InstanceIndex;
-    mat4 modelMatrix = ubo1.modelMatrices[nonuniformEXT(modelMatrixIdx)];
-    gl_Position = push.vp * modelMatrix * vec4(inPos, 1.0);
+    PerMeshData meshData = ubo0.modelData[inInstance.y];
+    outTexIndices = ubo2.materialTextures[meshData.matIdx].xyz;
+    mat4 modelMatrix = ubo1.modelMatrices[inInstance.x];
+    vec3 pos = inPos * meshData.positionScale + meshData.positionOffset;
+    vec3 normal = kCompactVertices ? decodeOctahedral(inNormal.xy) : inNormal;
+    vec3 tangent = kCompactVertices ? decodeOctahedral(inTangent.xy) : inTangent;
+    gl_Position = push.vp * modelMatrix * vec4(pos, 1.0);
     outUV = vec2(inUV.x, 1.0 - inUV.y);
-    vec3 N = normalize(vec3(modelMatrix * vec4(inNormal, 0.0)));
-    vec3 T = normalize(vec3(modelMatrix * vec4(inTangent, 0.0)));
+    vec3 N = normalize(vec3(modelMatrix * vec4(normal, 0.0)));
+    vec3 T = normalize(vec3(modelMatrix * vec4(tangent, 0.0)));
     vec3 B = cross(N, T);
     outTBN = mat3(T, B, N);
-}	
\ No newline at end of file
+}
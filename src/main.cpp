@@ -1,24 +1,29 @@
 #include <algorithm>
+#include <chrono>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
 #include <iostream>
 #include <json.hpp>
+#include <string>
 #include <thread>
 
+#include "vkallocbench.hpp"
 #include "vkcamera.hpp"
 #include "vkcompute.hpp"
+#include "vkdefrag.hpp"
 #include "vkdescriptor.hpp"
 #include "vkmemory.hpp"
 #include "vkmodel.hpp"
 #include "vkpresent.hpp"
 #include "vkrender.hpp"
 #include "vkshader.hpp"
+#include "vksystem.hpp"
 #include "vktexture.hpp"
 
 using json = nlohmann::json;
 
-int main() {
+int main(int argc, char** argv) {
   try {
     CameraInputHandler camera;
 
@@ -31,8 +36,18 @@ int main() {
 
     vw::QueueWorkType mainWorkType{vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute, window.getSurface()};
 
-    std::array<const std::string, 2> deviceExtensions{vw::swapchainExtension, VK_KHR_SHADER_NON_SEMANTIC_INFO_EXTENSION_NAME};
-    vw::Device device{instance.findPhysicalDevice(mainWorkType, vw::swapchainExtension).value(), deviceExtensions};
+    std::vector<std::string> deviceExtensions{vw::swapchainExtension, VK_KHR_SHADER_NON_SEMANTIC_INFO_EXTENSION_NAME};
+    vk::PhysicalDevice physicalDevice = instance.findPhysicalDevice(mainWorkType, vw::swapchainExtension).value();
+    // Real heap budgets for the memory report where the driver has them
+    const bool memoryBudget = vw::PhysicalDevice{physicalDevice}.queryExtensionSupport(std::string{VK_EXT_MEMORY_BUDGET_EXTENSION_NAME});
+    if (memoryBudget)
+      deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    vw::Device device{physicalDevice, deviceExtensions};
+    // --allocation-benchmark only measures concurrent buffer creation, single mutex against allocation stripes
+    if (argc > 1 && std::string{argv[1]} == "--allocation-benchmark") {
+      vw::benchmarkConcurrentAllocation(std::max(std::thread::hardware_concurrency(), 1u), 4000);
+      return 0;
+    }
     auto& queue = device.getPreferredQueue(mainWorkType);
 
     vw::Swapchain swapchain{device.getPhysicalDevice(), window.getSurface(), queue};
@@ -79,34 +94,116 @@ int main() {
       glm::mat4 inverseVP;
     };
 
-    vw::Shader offscreenVertShader{vk::ShaderStageFlagBits::eVertex,
-                                   vw::loadShader("shaders/offscreen.vert.spv"),
-                                   {{vk::DescriptorType::eStorageBuffer}, {vk::DescriptorType::eStorageBuffer}},
-                                   sizeof(OffscreenPushData)};
-    vw::Shader offscreenFragShader{
-        vk::ShaderStageFlagBits::eFragment, vw::loadShader("shaders/offscreen.frag.spv"), {{vk::DescriptorType::eCombinedImageSampler, 400, 0, true}}};
-    vw::Shader deferredCompShader{
-        vk::ShaderStageFlagBits::eCompute,
-        vw::loadShader("shaders/deferred.comp.spv"),
-        {{vk::DescriptorType::eCombinedImageSampler, 4}, {vk::DescriptorType::eUniformBuffer}, {vk::DescriptorType::eStorageImage, 1, 1}},
-        sizeof(DeferredPushData)};
-
     glm::mat4 model = glm::identity<glm::mat4>();
     glm::mat4 proj = glm::perspective(glm::radians(70.0f), static_cast<float>(windowExtent.width / windowExtent.height), 0.1f, 10000.0f);
 
-    vw::MemoryAllocator allocator;
+    // One allocation stripe per texture decode thread (textureDecodeThreads = 0 uses every hardware thread)
+    vw::MemoryAllocator allocator{memoryBudget, std::max(std::thread::hardware_concurrency(), 1u)};
 
+    // Two staging regions let the import fill one while the other is copied, larger uploads are split into chunks
+    constexpr uint32_t kStagingRegions = 2;
     auto& transferQueue = device.getPreferredQueue({vk::QueueFlagBits::eTransfer});
-    transferQueue.allocateOneTimeBuffers(1);
-
-    vk::DeviceSize stagingSize = 170 * 1024 * 1024;
-    vw::StagingBuffer stagingBuffer{allocator, stagingSize, transferQueue};
-    vw::Scene scene{allocator, stagingBuffer, "SunTemple/SunTemple.fbx"};
+    transferQueue.allocateOneTimeBuffers(kStagingRegions);
+    // Texture mips are blitted at upload time, which needs a graphics queue
+    queue.allocateOneTimeBuffers(kStagingRegions);
+
+    vk::DeviceSize stagingSize = 64 * 1024 * 1024;
+    vw::StagingBuffer stagingBuffer{allocator, stagingSize, transferQueue, &queue, kStagingRegions};
+    // --upload-selftest writes a pattern through queueBufferWrite into a directUpload buffer and a staged one, then reads both back from the
+    // device. The direct buffer only gets DEVICE_LOCAL | HOST_VISIBLE memory where the driver has it, the output says which path ran
+    if (argc > 1 && std::string{argv[1]} == "--upload-selftest") {
+      std::vector<uint32_t> pattern(256 * 1024);
+      for (size_t i = 0; i < pattern.size(); ++i)
+        pattern[i] = static_cast<uint32_t>(i * 2654435761u);
+      constexpr vk::BufferUsageFlags kUsage = vw::BufferUse::kVertexBuffer | vk::BufferUsageFlagBits::eTransferSrc;
+      auto checkUpload = [&](bool directUpload) {
+        vw::Buffer buffer{allocator, vw::byteSize(pattern), kUsage, VMA_MEMORY_USAGE_GPU_ONLY, directUpload};
+        stagingBuffer.queueBufferWrite(pattern, buffer);
+        stagingBuffer.flush();
+        stagingBuffer.wait();
+        vw::Buffer readback{allocator, vw::byteSize(pattern), vk::BufferUsageFlagBits::eTransferDst, VMA_MEMORY_USAGE_GPU_TO_CPU};
+        // Host writes to the mapped buffer are made visible to the copy by the submission itself
+        auto fence = queue.oneTimeRecordSubmit(
+            [&](vw::CommandBuffer& cmdBuffer) { cmdBuffer.copyBuffer(buffer, readback, vk::BufferCopy{0, 0, vw::byteSize(pattern)}); });
+        fence->wait();
+        std::vector<uint32_t> result(pattern.size());
+        readback.copyFromMapped(result);
+        const bool passed = result == pattern;
+        std::cout << (directUpload ? "directUpload buffer: " : "Staged buffer: ") << (buffer.isMapped() ? "written in place" : "staged copy") << ", "
+                  << (passed ? "passed" : "FAILED") << std::endl;
+        return passed;
+      };
+      const bool directPassed = checkUpload(true);
+      const bool stagedPassed = checkUpload(false);
+      return directPassed && stagedPassed ? 0 : 1;
+    }
+    // textureDecodeThreads = 1 reproduces the serial texture decode, vertexFormat/vertexLayout select the vertex encoding for comparison
+    auto swapImageCount = vw::size32(swapchain.getImageViews());
+    vw::SceneOptions sceneOptions;
+    sceneOptions.lodCount = 4;
+    sceneOptions.frameSlotCount = swapImageCount;
+    // --import-benchmark compares the scene import with serial and pooled texture decoding. Both runs decode every texture from its source
+    // file, no scene or texture cache is read, a first untimed import only warms up the OS file cache
+    if (argc > 1 && std::string{argv[1]} == "--import-benchmark") {
+      auto timeImport = [&](uint32_t decodeThreads) {
+        vw::SceneOptions options = sceneOptions;
+        options.textureDecodeThreads = decodeThreads;
+        options.compressTextures = false;
+        options.sceneCache = false;
+        auto start = std::chrono::high_resolution_clock::now();
+        vw::Scene benchmarkScene{allocator, stagingBuffer, "SunTemple/SunTemple.fbx", options};
+        stagingBuffer.flush();
+        stagingBuffer.wait();
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+      };
+      timeImport(0);
+      double serialMs = timeImport(1);
+      double pooledMs = timeImport(0);
+      std::cout << "Import from source (Assimp, stb_image decode, Cpu mips for diffuse maps, no scene or texture cache)" << std::endl;
+      std::cout << "Scene import: " << serialMs << " ms with 1 decode thread, " << pooledMs << " ms with " << std::max(std::thread::hardware_concurrency(), 1u)
+                << ", speedup " << serialMs / pooledMs << "x" << std::endl;
+      return 0;
+    }
+    // The peak resident size before and after shows how much memory the import itself needed at most
+    constexpr double kMiB = 1024.0 * 1024.0;
+    const size_t peakBeforeImport = vw::getPeakResidentBytes();
+    auto importStart = std::chrono::high_resolution_clock::now();
+    vw::Scene scene{allocator, stagingBuffer, "SunTemple/SunTemple.fbx", sceneOptions};
     if (scene.meshes().size() == 0)
       throw std::runtime_error("Invalid model file");
     stagingBuffer.flush();
+    stagingBuffer.wait();
+    auto importTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - importStart);
+    std::cout << "Scene import: " << importTime.count() << " ms" << std::endl;
+    std::cout << "Peak resident memory: " << peakBeforeImport / kMiB << " MiB before import, " << vw::getPeakResidentBytes() / kMiB << " MiB after" << std::endl;
+
+    auto printFragmentation = [&](const char* when) {
+      vw::MemoryAllocator::Fragmentation fragmentation = allocator.getFragmentation();
+      std::cout << "Fragmentation " << when << ": " << fragmentation.unusedBytes / kMiB << " of " << fragmentation.blockBytes / kMiB << " MiB unused in "
+                << fragmentation.blockCount << " blocks, " << fragmentation.unusedRangeCount << " free ranges, ratio " << fragmentation.ratio() << std::endl;
+    };
+    printFragmentation("after import");
+    // Compacts the scene's geometry and textures while rendering, a few MiB of copies per frame at most
+    constexpr vk::DeviceSize kDefragBytesPerFrame = 4 * 1024 * 1024;
+    vw::Defragmenter defragmenter{allocator, swapImageCount, kDefragBytesPerFrame};
+    scene.addMovable(defragmenter);
 
-    vw::Buffer ubo{allocator, vw::byteSize(lightInfos), vw::BufferUse::kUniformBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU};
+    vw::Shader offscreenVertShader{vk::ShaderStageFlagBits::eVertex,
+                                   vw::loadShader("shaders/offscreen.vert.spv"),
+                                   {{vk::DescriptorType::eStorageBuffer}, {vk::DescriptorType::eStorageBuffer}, {vk::DescriptorType::eStorageBuffer}},
+                                   sizeof(OffscreenPushData)};
+    vw::Shader offscreenFragShader{vk::ShaderStageFlagBits::eFragment,
+                                   vw::loadShader("shaders/offscreen.frag.spv"),
+                                   {{vk::DescriptorType::eCombinedImageSampler, scene.textureCount(), 0, true}}};
+    vw::Shader deferredCompShader{
+        vk::ShaderStageFlagBits::eCompute,
+        vw::loadShader("shaders/deferred.comp.spv"),
+        {{vk::DescriptorType::eCombinedImageSampler, 4}, {vk::DescriptorType::eUniformBufferDynamic}, {vk::DescriptorType::eStorageImage, 1, 1}},
+        sizeof(DeferredPushData)};
+
+    // Transient per-frame constants, one slot per swapchain image so a frame never overwrites data the GPU is still reading
+    constexpr vk::DeviceSize kFrameDataSize = 64 * 1024;
+    vw::FrameAllocator frameData{allocator, kFrameDataSize, swapImageCount};
 
     vk::ImageUsageFlags gBufferUseFlags = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eSampled;
     vw::Image gAlbedo{allocator, vk::Format::eR8G8B8A8Unorm, windowExtent, gBufferUseFlags};
@@ -115,6 +212,10 @@ int main() {
 
     vw::Image depthAttachment{allocator, vk::Format::eD32Sfloat, windowExtent,
                               vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled};
+    gAlbedo.setDebugInfo(vw::MemoryCategory::RenderTarget, "gAlbedo");
+    gSpecular.setDebugInfo(vw::MemoryCategory::RenderTarget, "gSpecular");
+    gNormal.setDebugInfo(vw::MemoryCategory::RenderTarget, "gNormal");
+    depthAttachment.setDebugInfo(vw::MemoryCategory::RenderTarget, "depth");
 
     vw::RenderPass offscreenRenderpass{{vw::RenderPass::colorAtt(vk::Format::eR8G8B8A8Unorm, true, vk::ImageLayout::eShaderReadOnlyOptimal),
                                         vw::RenderPass::colorAtt(vk::Format::eR8G8B8A8Unorm, true, vk::ImageLayout::eShaderReadOnlyOptimal),
@@ -141,9 +242,12 @@ int main() {
     vk::Viewport viewport{{}, {}, static_cast<float>(windowExtent.width), static_cast<float>(windowExtent.height), 0.0f, 1.0f};
 
     vw::GraphicsPipelineBuilder offScreenPipelineBuilder{offscreenPipelineLayout, offscreenRenderpass};
-    offScreenPipelineBuilder.addShaderStage(vk::ShaderStageFlagBits::eVertex, offscreenVertShader);
+    vk::Bool32 compactVertices = (scene.vertexFormat() == vw::VertexFormat::Compact);
+    vk::SpecializationMapEntry compactVerticesEntry{0, 0, sizeof(compactVertices)};
+    vk::SpecializationInfo offscreenVertSpecialization{1, &compactVerticesEntry, sizeof(compactVertices), &compactVertices};
+    offScreenPipelineBuilder.addShaderStage(vk::ShaderStageFlagBits::eVertex, offscreenVertShader, &offscreenVertSpecialization);
     offScreenPipelineBuilder.addShaderStage(vk::ShaderStageFlagBits::eFragment, offscreenFragShader);
-    offScreenPipelineBuilder.setVertexInputState(vw::kInputBindings, vw::kInputAttributes);
+    offScreenPipelineBuilder.setVertexInputState(scene.vertexInput().bindings, scene.vertexInput().attributes);
     offScreenPipelineBuilder.setInputAssemblyState(vk::PrimitiveTopology::eTriangleList, false);
     offScreenPipelineBuilder.setViewportState(viewport, windowRect);
     offScreenPipelineBuilder.setRasterizationState(vk::PolygonMode::eFill, vk::CullModeFlagBits::eBack);
@@ -155,8 +259,9 @@ int main() {
 
     vw::ComputePipeline deferredComputePipeline{deferredCompPipelineLayout, deferredCompShader};
 
-    auto offscreenDescriptorPool = offscreenPipelineLayout.getDescLayouts()[0].createDedicatedPool(1, 3 * scene.materials().size());
-    auto offscreenDescriptorSet = offscreenDescriptorPool.getSets()[0];
+    // One offscreen set per frame slot, a slot's set is written again before use when the defragmenter moved scene resources since
+    auto offscreenDescriptorPool = offscreenPipelineLayout.getDescLayouts()[0].createDedicatedPool(swapImageCount, scene.textureCount());
+    auto& offscreenDescriptorSets = offscreenDescriptorPool.getSets();
     auto deferredDescriptorPool = deferredCompPipelineLayout.getDescLayouts()[0].createDedicatedPool(1);
     auto deferredDescriptorSet = deferredDescriptorPool.getSets()[0];
 
@@ -164,26 +269,28 @@ int main() {
                                                               {nearSampler, gSpecularView, vk::ImageLayout::eShaderReadOnlyOptimal},
                                                               {nearSampler, gNormalView, vk::ImageLayout::eShaderReadOnlyOptimal},
                                                               {nearSampler, depthAttachmentView, vk::ImageLayout::eShaderReadOnlyOptimal}};
-    vk::DescriptorBufferInfo deferredDescriptorUboInfo{ubo, 0, vw::byteSize(lightInfos)};
+    vk::DescriptorBufferInfo deferredDescriptorUboInfo = frameData.getDescriptorInfo(vw::byteSize(lightInfos));
 
     device.updateDescriptorSets({deferredDescriptorSet.writeImages(0, vk::DescriptorType::eCombinedImageSampler, deferredDescriptorImageInfos),
-                                 deferredDescriptorSet.writeBuffers(1, vk::DescriptorType::eUniformBuffer, deferredDescriptorUboInfo),
-                                 offscreenDescriptorSet.writeBuffers(0, vk::DescriptorType::eStorageBuffer, scene.perMeshShaderDataDesc()),
-                                 offscreenDescriptorSet.writeBuffers(1, vk::DescriptorType::eStorageBuffer, scene.modelMatrixArrayDesc())},
+                                 deferredDescriptorSet.writeBuffers(1, vk::DescriptorType::eUniformBufferDynamic, deferredDescriptorUboInfo)},
                                 {});
 
-    std::vector<vk::DescriptorImageInfo> matDescInfos;
-    matDescInfos.reserve(scene.materials().size() * 3);
-    for (auto& mat : scene.materials()) {
-      auto descImageInfos = mat.getTextureDescriptorInfos(linearSampler);
-      matDescInfos.insert(matDescInfos.end(), descImageInfos.begin(), descImageInfos.end());
-    }
-    device.updateDescriptorSets(offscreenDescriptorSet.writeImages(2, vk::DescriptorType::eCombinedImageSampler, matDescInfos), {});
+    std::vector<uint64_t> offscreenSetGenerations(swapImageCount);
+    auto writeOffscreenDescriptorSet = [&](uint32_t slot) {
+      vw::DescriptorSet& set = offscreenDescriptorSets[slot];
+      auto textureDescInfos = scene.textureDescriptorInfos(linearSampler);
+      device.updateDescriptorSets({set.writeBuffers(0, vk::DescriptorType::eStorageBuffer, scene.perMeshShaderDataDesc()),
+                                   set.writeBuffers(1, vk::DescriptorType::eStorageBuffer, scene.modelMatrixArrayDesc()),
+                                   set.writeBuffers(2, vk::DescriptorType::eStorageBuffer, scene.materialArrayDesc()),
+                                   set.writeImages(3, vk::DescriptorType::eCombinedImageSampler, textureDescInfos)},
+                                  {});
+      offscreenSetGenerations[slot] = defragmenter.getGeneration();
+    };
+    for (uint32_t slot = 0; slot < swapImageCount; ++slot)
+      writeOffscreenDescriptorSet(slot);
 
     vw::Framebuffer offscreenFramebuffer{offscreenRenderpass, {gAlbedoView, gSpecularView, gNormalView, depthAttachmentView}, windowExtent};
 
-    auto swapImageCount = vw::size32(swapchain.getImageViews());
-
     auto swapImageDescriptorPool = deferredCompPipelineLayout.getDescLayouts()[1].createDedicatedPool(swapImageCount);
     auto swapImageDescriptorSets = swapImageDescriptorPool.getSets();
 
@@ -198,10 +305,23 @@ int main() {
     vw::Semaphore imageAvailable, renderingFinished;
     vk::PipelineStageFlags colorOutFlags = vk::PipelineStageFlagBits::eColorAttachmentOutput;
     queue.allocateOneTimeBuffers(swapImageCount);
+    // The scene's per-frame draw data is rewritten every frame, one slot per frame in flight
+    std::vector<std::shared_ptr<vw::Fence>> frameSlotFences(swapImageCount);
+    uint32_t frameSlot = 0;
+    uint32_t frameIndex = 0;
+    float pixelsPerUnit = std::abs(proj[1][1]) * windowExtent.height * 0.5f;
     window.untilClosed([&] {
-      ubo.copyToMapped(lightInfos);
       if (!queue.hasReadyBuffer())
         return;
+      allocator.setFrameIndex(frameIndex++);
+      frameData.beginFrame();
+      uint32_t lightInfosOffset = frameData.push(lightInfos);
+      if (frameSlotFences[frameSlot])
+        frameSlotFences[frameSlot]->wait();
+      defragmenter.beginFrame();
+      if (offscreenSetGenerations[frameSlot] != defragmenter.getGeneration())
+        writeOffscreenDescriptorSet(frameSlot);
+      scene.selectLods(frameSlot, {camera.getPos(), pixelsPerUnit});
 
       glm::mat4 view = camera.getView();
       glm::mat4 vp = proj * view;
@@ -209,27 +329,36 @@ int main() {
       DeferredPushData deferredPush{camera.getPos(), 1.0f, glm::inverse(vp)};
 
       auto imageIndex = swapchain.getNextImageIndex(imageAvailable);
-      queue.oneTimeRecordSubmit(
+      frameSlotFences[frameSlot] = queue.oneTimeRecordSubmit(
           [&](vw::CommandBuffer& commandBuffer) {
+            defragmenter.record(commandBuffer);
             commandBuffer.beginRenderPass(offscreenRenderpass, offscreenFramebuffer, windowRect, clearValues, vk::SubpassContents::eInline);
             commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, offscreenPipeline);
             commandBuffer.pushConstants(offscreenPipelineLayout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(offscreenPush), &offscreenPush);
-            commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, offscreenPipelineLayout, 0, {offscreenDescriptorSet}, {});
-            scene.draw(commandBuffer);
+            commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, offscreenPipelineLayout, 0, {offscreenDescriptorSets[frameSlot]}, {});
+            scene.draw(commandBuffer, frameSlot);
             commandBuffer.endRenderPass();
 
             vw::Image::transitionLayout(commandBuffer, swapchain.getImage(imageIndex), vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral);
             commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, deferredComputePipeline);
             commandBuffer.pushConstants(deferredCompPipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(deferredPush), &deferredPush);
             commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, deferredCompPipelineLayout, 0,
-                                             {deferredDescriptorSet, swapImageDescriptorSets[imageIndex]}, {});
+                                             {deferredDescriptorSet, swapImageDescriptorSets[imageIndex]}, {lightInfosOffset});
             commandBuffer.dispatch(windowExtent.width, windowExtent.height, 1);
             vw::Image::transitionLayout(commandBuffer, swapchain.getImage(imageIndex), vk::ImageLayout::eGeneral, vk::ImageLayout::ePresentSrcKHR);
           },
           {imageAvailable}, {colorOutFlags}, {renderingFinished});
+      frameData.endFrame(frameSlotFences[frameSlot]);
+      defragmenter.endFrame(frameSlotFences[frameSlot]);
       swapchain.present(imageIndex, {renderingFinished});
+      frameSlot = (frameSlot + 1) % swapImageCount;
     });
     device.waitIdle();
+    const VmaDefragmentationStats& defragStats = defragmenter.getStats();
+    std::cout << "Defragmentation moved " << defragStats.allocationsMoved << " allocations (" << defragStats.bytesMoved / kMiB << " MiB) and freed "
+              << defragStats.deviceMemoryBlocksFreed << " blocks (" << defragStats.bytesFreed / kMiB << " MiB)" << std::endl;
+    printFragmentation("at exit");
+    allocator.writeReport("memory_report.json");
   } catch (vk::SystemError& error) {
     std::cout << "vk::SystemError: " << error.what() << std::endl;
     exit(-1);
@@ -0,0 +1,56 @@
+#include "vkallocbench.hpp"
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "vkmemory.hpp"
+
+namespace {
+constexpr uint32_t kLiveBuffersPerThread = 16;
+
+// Replaces the oldest live buffer with a new one per step, the sizes cycle through 16 KiB - 1 MiB. mutex = nullptr allocates without a lock
+void allocationLoop(vw::MemoryAllocator& allocator, uint32_t threadIndex, uint32_t allocationCount, std::mutex* mutex) {
+  std::vector<std::optional<vw::Buffer>> live(kLiveBuffersPerThread);
+  for (uint32_t i = 0; i < allocationCount; ++i) {
+    vk::DeviceSize size = vk::DeviceSize{16 * 1024} << ((threadIndex + i) % 7);
+    std::unique_lock<std::mutex> lock = mutex ? std::unique_lock<std::mutex>{*mutex} : std::unique_lock<std::mutex>{};
+    std::optional<vw::Buffer>& slot = live[i % kLiveBuffersPerThread];
+    slot.reset();
+    slot.emplace(allocator, size, vw::BufferUse::kDeviceStorageBuffer);
+  }
+  std::unique_lock<std::mutex> lock = mutex ? std::unique_lock<std::mutex>{*mutex} : std::unique_lock<std::mutex>{};
+  live.clear();
+}
+
+// Wall time in seconds until all threads finished
+double runThreads(vw::MemoryAllocator& allocator, uint32_t threadCount, uint32_t allocationsPerThread, std::mutex* mutex) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < threadCount; ++t)
+    threads.emplace_back(allocationLoop, std::ref(allocator), t, allocationsPerThread, mutex);
+  for (auto& thread : threads)
+    thread.join();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+}  // namespace
+
+void vw::benchmarkConcurrentAllocation(uint32_t maxThreadCount, uint32_t allocationsPerThread) {
+  for (uint32_t threadCount = 1; threadCount <= maxThreadCount; threadCount *= 2) {
+    double mutexSeconds = 0.0, stripedSeconds = 0.0;
+    {
+      vw::MemoryAllocator allocator;
+      std::mutex mutex;
+      mutexSeconds = runThreads(allocator, threadCount, allocationsPerThread, &mutex);
+    }
+    {
+      vw::MemoryAllocator allocator{false, threadCount};
+      stripedSeconds = runThreads(allocator, threadCount, allocationsPerThread, nullptr);
+    }
+    double allocationCount = static_cast<double>(threadCount) * allocationsPerThread;
+    std::cout << threadCount << " threads: " << allocationCount / mutexSeconds << " allocations/s behind a single mutex, " << allocationCount / stripedSeconds
+              << " allocations/s striped" << std::endl;
+  }
+}
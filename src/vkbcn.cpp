@@ -0,0 +1,185 @@
+#include "vkbcn.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+// Texels of a 4x4 block in row-major order
+using Block = std::array<std::array<uint8_t, 4>, 16>;
+
+uint16_t packRgb565(const float rgb[3]) {
+  auto quantize = [](float value, int maxValue) { return std::clamp(static_cast<int>(value * maxValue / 255.0f + 0.5f), 0, maxValue); };
+  return static_cast<uint16_t>((quantize(rgb[0], 31) << 11) | (quantize(rgb[1], 63) << 5) | quantize(rgb[2], 31));
+}
+
+std::array<int, 3> unpackRgb565(uint16_t color) {
+  int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+  return {(r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2)};
+}
+
+// Endpoints span the block's colors along their principal axis, every texel then picks the closest of the four palette entries
+void encodeColorBlock(const Block& block, uint8_t* out) {
+  float mean[3] = {};
+  for (const auto& texel : block)
+    for (int c = 0; c < 3; ++c)
+      mean[c] += texel[c] / 16.0f;
+  float cov[6] = {};  // rr rg rb gg gb bb
+  for (const auto& texel : block) {
+    float d[3] = {texel[0] - mean[0], texel[1] - mean[1], texel[2] - mean[2]};
+    cov[0] += d[0] * d[0], cov[1] += d[0] * d[1], cov[2] += d[0] * d[2];
+    cov[3] += d[1] * d[1], cov[4] += d[1] * d[2], cov[5] += d[2] * d[2];
+  }
+  float axis[3] = {1.0f, 1.0f, 1.0f};
+  for (int i = 0; i < 8; ++i) {
+    float next[3] = {cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2], cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                     cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]};
+    float scale = std::max({std::abs(next[0]), std::abs(next[1]), std::abs(next[2])});
+    if (scale < 1e-6f)
+      break;
+    for (int c = 0; c < 3; ++c)
+      axis[c] = next[c] / scale;
+  }
+  float axisLength = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+  for (float& a : axis)
+    a /= axisLength;
+
+  float minT = std::numeric_limits<float>::max(), maxT = std::numeric_limits<float>::lowest();
+  for (const auto& texel : block) {
+    float t = (texel[0] - mean[0]) * axis[0] + (texel[1] - mean[1]) * axis[1] + (texel[2] - mean[2]) * axis[2];
+    minT = std::min(minT, t);
+    maxT = std::max(maxT, t);
+  }
+  // Insetting by 1/16 of the range lowers the average error, the extremes are rarely worth an endpoint of their own
+  float inset = (maxT - minT) / 16.0f;
+  minT += inset;
+  maxT -= inset;
+  float end0[3], end1[3];
+  for (int c = 0; c < 3; ++c) {
+    end0[c] = mean[c] + axis[c] * maxT;
+    end1[c] = mean[c] + axis[c] * minT;
+  }
+  uint16_t color0 = packRgb565(end0), color1 = packRgb565(end1);
+  // color0 > color1 selects the four color mode
+  if (color0 < color1)
+    std::swap(color0, color1);
+
+  uint32_t indices = 0;
+  if (color0 != color1) {
+    std::array<std::array<int, 3>, 4> palette;
+    palette[0] = unpackRgb565(color0);
+    palette[1] = unpackRgb565(color1);
+    for (int c = 0; c < 3; ++c) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+    for (uint32_t i = 0; i < 16; ++i) {
+      uint32_t best = 0;
+      int bestDistance = std::numeric_limits<int>::max();
+      for (uint32_t p = 0; p < 4; ++p) {
+        int dr = block[i][0] - palette[p][0], dg = block[i][1] - palette[p][1], db = block[i][2] - palette[p][2];
+        int distance = dr * dr + dg * dg + db * db;
+        if (distance < bestDistance) {
+          bestDistance = distance;
+          best = p;
+        }
+      }
+      indices |= best << (2 * i);
+    }
+  }
+  out[0] = static_cast<uint8_t>(color0 & 0xff);
+  out[1] = static_cast<uint8_t>(color0 >> 8);
+  out[2] = static_cast<uint8_t>(color1 & 0xff);
+  out[3] = static_cast<uint8_t>(color1 >> 8);
+  for (int i = 0; i < 4; ++i)
+    out[4 + i] = static_cast<uint8_t>(indices >> (8 * i));
+}
+
+// BC4 block in the eight value mode spanning the channel's range
+void encodeChannelBlock(const Block& block, uint32_t channel, uint8_t* out) {
+  uint8_t lo = 255, hi = 0;
+  for (const auto& texel : block) {
+    lo = std::min(lo, texel[channel]);
+    hi = std::max(hi, texel[channel]);
+  }
+  uint64_t indices = 0;
+  if (hi > lo) {
+    std::array<int, 8> palette{hi, lo};
+    for (int i = 2; i < 8; ++i)
+      palette[i] = ((8 - i) * hi + (i - 1) * lo + 3) / 7;
+    for (uint32_t i = 0; i < 16; ++i) {
+      uint64_t best = 0;
+      int bestDistance = std::numeric_limits<int>::max();
+      for (uint32_t p = 0; p < 8; ++p) {
+        int distance = std::abs(block[i][channel] - palette[p]);
+        if (distance < bestDistance) {
+          bestDistance = distance;
+          best = p;
+        }
+      }
+      indices |= best << (3 * i);
+    }
+  }
+  out[0] = hi;
+  out[1] = lo;
+  for (int i = 0; i < 6; ++i)
+    out[2 + i] = static_cast<uint8_t>(indices >> (8 * i));
+}
+}  // namespace
+
+std::vector<std::byte> vw::compressImage(const std::byte* texels, uint32_t width, uint32_t height, uint32_t channelCount, vk::Format format) {
+  uint32_t blockSize = 0;
+  uint32_t requiredChannels = 0;
+  switch (format) {
+    case vk::Format::eBc1RgbaUnormBlock:
+      blockSize = 8, requiredChannels = 4;
+      break;
+    case vk::Format::eBc3UnormBlock:
+      blockSize = 16, requiredChannels = 4;
+      break;
+    case vk::Format::eBc4UnormBlock:
+      blockSize = 8, requiredChannels = 1;
+      break;
+    case vk::Format::eBc5UnormBlock:
+      blockSize = 16, requiredChannels = 2;
+      break;
+    default:
+      throw std::runtime_error("Unsupported block compression format " + vk::to_string(format));
+  }
+  if (channelCount < requiredChannels || channelCount > 4)
+    throw std::runtime_error("Not enough channels for " + vk::to_string(format));
+
+  const uint32_t blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+  std::vector<std::byte> compressed(static_cast<size_t>(blocksX) * blocksY * blockSize);
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(texels);
+  uint8_t* dst = reinterpret_cast<uint8_t*>(compressed.data());
+  Block block{};
+  for (uint32_t by = 0; by < blocksY; ++by) {
+    for (uint32_t bx = 0; bx < blocksX; ++bx) {
+      for (uint32_t i = 0; i < 16; ++i) {
+        uint32_t x = std::min(bx * 4 + i % 4, width - 1), y = std::min(by * 4 + i / 4, height - 1);
+        std::memcpy(block[i].data(), src + (static_cast<size_t>(y) * width + x) * channelCount, channelCount);
+      }
+      switch (format) {
+        case vk::Format::eBc1RgbaUnormBlock:
+          encodeColorBlock(block, dst);
+          break;
+        case vk::Format::eBc3UnormBlock:
+          encodeChannelBlock(block, 3, dst);
+          encodeColorBlock(block, dst + 8);
+          break;
+        case vk::Format::eBc4UnormBlock:
+          encodeChannelBlock(block, 0, dst);
+          break;
+        default:
+          encodeChannelBlock(block, 0, dst);
+          encodeChannelBlock(block, 1, dst + 8);
+          break;
+      }
+      dst += blockSize;
+    }
+  }
+  return compressed;
+}
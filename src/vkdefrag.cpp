@@ -0,0 +1,301 @@
+#include "vkdefrag.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+// Planning a pass walks every block, so after a pass without moves the next one waits this many frames
+constexpr uint32_t kIdleFrames = 60;
+
+bool isDeviceLocal(VmaAllocator allocator, const VmaAllocationInfo& allocationInfo) {
+  VkMemoryPropertyFlags flags = 0;
+  vmaGetMemoryTypeProperties(allocator, allocationInfo.memoryType, &flags);
+  return (flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0;
+}
+
+vk::ImageSubresourceRange getWholeRange(const vk::ImageCreateInfo& createInfo) {
+  return {vk::ImageAspectFlagBits::eColor, 0, createInfo.mipLevels, 0, createInfo.arrayLayers};
+}
+}  // namespace
+
+vw::Defragmenter::Defragmenter(MemoryAllocator& allocator, uint32_t frameCount, vk::DeviceSize maxBytesPerFrame)
+    : mAllocator{allocator}, mFrameCount{std::max(frameCount, 1u)}, mMaxBytesPerFrame{maxBytesPerFrame} {}
+
+vw::Defragmenter::~Defragmenter() {
+  // With the device idle the recorded copies are done
+  if (mState == State::Recorded || mState == State::Copying)
+    switchHandles();
+  if (mState != State::Idle)
+    endPass();
+  for (Resource& resource : mResources) {
+    if (resource.buffer != nullptr)
+      resource.buffer->mDefragmenter = nullptr;
+    else
+      resource.image->mDefragmenter = nullptr;
+  }
+}
+
+bool vw::Defragmenter::add(vw::Buffer& buffer, std::function<void()> onMoved) {
+  std::lock_guard<std::recursive_mutex> lock{mMutex};
+  constexpr vk::BufferUsageFlags kCopyUsage = vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst;
+  if (buffer.mDefragmenter != nullptr)
+    throw std::runtime_error("Buffer is already movable");
+  if ((buffer.mCreateInfo.usage & kCopyUsage) != kCopyUsage)
+    throw std::runtime_error("Movable buffers need transfer source and destination usage");
+  if (buffer.isMapped() || !isDeviceLocal(buffer.mAllocator, buffer.mAllocationInfo))
+    return false;
+  mResources.push_back({&buffer, nullptr, vk::ImageLayout::eUndefined, std::move(onMoved)});
+  buffer.mDefragmenter = this;
+  return true;
+}
+
+bool vw::Defragmenter::add(vw::Image& image, vk::ImageLayout layout, std::function<void()> onMoved) {
+  std::lock_guard<std::recursive_mutex> lock{mMutex};
+  constexpr vk::ImageUsageFlags kCopyUsage = vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eTransferDst;
+  constexpr vk::ImageUsageFlags kWriteUsage =
+      vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eStorage;
+  if (image.mDefragmenter != nullptr)
+    throw std::runtime_error("Image is already movable");
+  if ((image.mCreateInfo.usage & kCopyUsage) != kCopyUsage)
+    throw std::runtime_error("Movable images need transfer source and destination usage");
+  if (image.mCreateInfo.usage & kWriteUsage)
+    throw std::runtime_error("Images written by the GPU can not be moved");
+  if (!isDeviceLocal(image.mAllocator, image.mAllocationInfo))
+    return false;
+  mResources.push_back({nullptr, &image, layout, std::move(onMoved)});
+  image.mDefragmenter = this;
+  return true;
+}
+
+void vw::Defragmenter::remove(vw::Buffer& buffer) {
+  std::lock_guard<std::recursive_mutex> lock{mMutex};
+  mResources.erase(std::remove_if(mResources.begin(), mResources.end(), [&](const Resource& resource) { return resource.buffer == &buffer; }),
+                   mResources.end());
+  buffer.mDefragmenter = nullptr;
+  if (mContext == VK_NULL_HANDLE)
+    return;
+  Orphan orphan{buffer.mHandle, nullptr, buffer.mAllocation, buffer.mCategory};
+  for (Move& move : mMoves) {
+    if (move.buffer != &buffer)
+      continue;
+    move.buffer = nullptr;
+    move.orphaned = true;
+    orphan.buffer = nullptr;
+  }
+  mOrphans.push_back(orphan);
+  buffer.mHandle = nullptr;
+}
+
+void vw::Defragmenter::remove(vw::Image& image) {
+  std::lock_guard<std::recursive_mutex> lock{mMutex};
+  mResources.erase(std::remove_if(mResources.begin(), mResources.end(), [&](const Resource& resource) { return resource.image == &image; }),
+                   mResources.end());
+  image.mDefragmenter = nullptr;
+  if (mContext == VK_NULL_HANDLE)
+    return;
+  Orphan orphan{nullptr, image.mHandle, image.mAllocation, image.mCategory};
+  for (Move& move : mMoves) {
+    if (move.image != &image)
+      continue;
+    move.image = nullptr;
+    move.orphaned = true;
+    orphan.image = nullptr;
+  }
+  mOrphans.push_back(orphan);
+  image.mHandle = nullptr;
+}
+
+VmaAllocation vw::Defragmenter::getAllocation(const Resource& resource) {
+  return (resource.buffer != nullptr) ? resource.buffer->mAllocation : resource.image->mAllocation;
+}
+
+void vw::Defragmenter::beginFrame() {
+  std::lock_guard<std::recursive_mutex> lock{mMutex};
+  if (mState == State::Copying && mCopyFence->signaled()) {
+    mCopyFence.reset();
+    switchHandles();
+  } else if (mState == State::Retiring && --mRetireFrames == 0) {
+    endPass();
+  }
+}
+
+void vw::Defragmenter::record(vk::CommandBuffer cmdBuffer) {
+  std::lock_guard<std::recursive_mutex> lock{mMutex};
+  if (mState != State::Idle || mResources.empty())
+    return;
+  if (mIdleFrames > 0) {
+    --mIdleFrames;
+    return;
+  }
+
+  std::vector<VmaAllocation> allocations;
+  allocations.reserve(mResources.size());
+  for (const Resource& resource : mResources)
+    allocations.push_back(getAllocation(resource));
+  VmaDefragmentationInfo2 info{};
+  info.flags = VMA_DEFRAGMENTATION_FLAG_INCREMENTAL;
+  info.allocationCount = vw::size32(allocations);
+  info.pAllocations = allocations.data();
+  info.maxCpuBytesToMove = mMaxBytesPerFrame;
+  info.maxCpuAllocationsToMove = UINT32_MAX;
+  info.maxGpuBytesToMove = mMaxBytesPerFrame;
+  info.maxGpuAllocationsToMove = UINT32_MAX;
+  VmaAllocator allocator = mAllocator.getHandle();
+  if (vmaDefragmentationBegin(allocator, &info, &mPassStats, &mContext) < VK_SUCCESS)
+    throw std::runtime_error("Failed to begin defragmentation");
+
+  // The pass takes every planned move at once, the byte budget already limited the plan
+  std::vector<VmaDefragmentationPassMoveInfo> passMoves(allocations.size());
+  VmaDefragmentationPassInfo passInfo{vw::size32(passMoves), passMoves.data()};
+  if (mContext == VK_NULL_HANDLE || vmaBeginDefragmentationPass(allocator, mContext, &passInfo) < VK_SUCCESS)
+    passInfo.moveCount = 0;
+  if (passInfo.moveCount == 0) {
+    mState = State::Retiring;
+    endPass();
+    mIdleFrames = kIdleFrames;
+    return;
+  }
+
+  for (uint32_t i = 0; i < passInfo.moveCount; ++i) {
+    const VmaDefragmentationPassMoveInfo& passMove = passMoves[i];
+    auto resource = std::find_if(mResources.begin(), mResources.end(), [&](const Resource& r) { return getAllocation(r) == passMove.allocation; });
+    Move& move = mMoves.emplace_back();
+    move.buffer = resource->buffer;
+    move.image = resource->image;
+    move.layout = resource->layout;
+    move.onMoved = resource->onMoved;
+    if (move.buffer != nullptr) {
+      move.oldBuffer = move.buffer->mHandle;
+      move.newBuffer = vw::g::device.createBuffer(move.buffer->mCreateInfo);
+      vw::g::device.bindBufferMemory(move.newBuffer, passMove.memory, passMove.offset);
+    } else {
+      move.oldImage = move.image->mHandle;
+      move.newImage = vw::g::device.createImage(move.image->mCreateInfo);
+      vw::g::device.bindImageMemory(move.newImage, passMove.memory, passMove.offset);
+    }
+  }
+  recordCopies(cmdBuffer);
+  mState = State::Recorded;
+}
+
+void vw::Defragmenter::recordCopies(vk::CommandBuffer cmdBuffer) const {
+  std::vector<vk::ImageMemoryBarrier> barriers;
+  vk::PipelineStageFlags srcStages, dstStages;
+  auto recordBarriers = [&]() {
+    if (!barriers.empty())
+      cmdBuffer.pipelineBarrier(srcStages, dstStages, {}, {}, {}, barriers);
+    barriers.clear();
+    srcStages = dstStages = {};
+  };
+
+  for (const Move& move : mMoves) {
+    if (move.image == nullptr)
+      continue;
+    vk::ImageSubresourceRange range = getWholeRange(move.image->mCreateInfo);
+    barriers.push_back(vw::Image::getLayoutBarrier(move.oldImage, move.layout, vk::ImageLayout::eTransferSrcOptimal, range, srcStages, dstStages));
+    barriers.push_back(
+        vw::Image::getLayoutBarrier(move.newImage, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, range, srcStages, dstStages));
+  }
+  recordBarriers();
+
+  bool copiedBuffers = false;
+  std::vector<vk::ImageCopy> regions;
+  for (const Move& move : mMoves) {
+    if (move.buffer != nullptr) {
+      cmdBuffer.copyBuffer(move.oldBuffer, move.newBuffer, vk::BufferCopy{0, 0, move.buffer->mCreateInfo.size});
+      copiedBuffers = true;
+      continue;
+    }
+    const vk::ImageCreateInfo& createInfo = move.image->mCreateInfo;
+    regions.clear();
+    for (uint32_t mip = 0; mip < createInfo.mipLevels; ++mip) {
+      vk::ImageSubresourceLayers layers{vk::ImageAspectFlagBits::eColor, mip, 0, createInfo.arrayLayers};
+      regions.emplace_back(layers, vk::Offset3D{}, layers, vk::Offset3D{}, vw::getMipExtent(createInfo.extent, mip));
+    }
+    cmdBuffer.copyImage(move.oldImage, vk::ImageLayout::eTransferSrcOptimal, move.newImage, vk::ImageLayout::eTransferDstOptimal, regions);
+  }
+
+  // The new buffers are read by any later command, through whatever descriptor or binding gets switched to them
+  if (copiedBuffers) {
+    vk::MemoryBarrier barrier{vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eMemoryRead};
+    cmdBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eAllCommands, {}, barrier, {}, {});
+  }
+  for (const Move& move : mMoves) {
+    if (move.image == nullptr)
+      continue;
+    vk::ImageSubresourceRange range = getWholeRange(move.image->mCreateInfo);
+    barriers.push_back(vw::Image::getLayoutBarrier(move.oldImage, vk::ImageLayout::eTransferSrcOptimal, move.layout, range, srcStages, dstStages));
+    barriers.push_back(vw::Image::getLayoutBarrier(move.newImage, vk::ImageLayout::eTransferDstOptimal, move.layout, range, srcStages, dstStages));
+  }
+  recordBarriers();
+}
+
+void vw::Defragmenter::endFrame(std::shared_ptr<vw::Fence> fence) {
+  std::lock_guard<std::recursive_mutex> lock{mMutex};
+  if (mState == State::Recorded) {
+    mCopyFence = std::move(fence);
+    mState = State::Copying;
+  }
+}
+
+void vw::Defragmenter::switchHandles() {
+  for (Move& move : mMoves) {
+    if (move.buffer != nullptr)
+      move.buffer->mHandle = move.newBuffer;
+    else if (move.image != nullptr)
+      move.image->mHandle = move.newImage;
+    else
+      continue;
+    if (move.onMoved)
+      move.onMoved();
+  }
+  ++mGeneration;
+  mRetireFrames = mFrameCount;
+  mState = State::Retiring;
+}
+
+void vw::Defragmenter::endPass() {
+  // Frames in flight are done with the old handles by now, the handles of destroyed resources go as well
+  for (const Move& move : mMoves) {
+    if (move.oldBuffer)
+      vw::g::device.destroyBuffer(move.oldBuffer);
+    if (move.oldImage)
+      vw::g::device.destroyImage(move.oldImage);
+    if (move.orphaned && move.newBuffer)
+      vw::g::device.destroyBuffer(move.newBuffer);
+    if (move.orphaned && move.newImage)
+      vw::g::device.destroyImage(move.newImage);
+  }
+  mRetired.clear();
+
+  VmaAllocator allocator = mAllocator.getHandle();
+  if (mContext != VK_NULL_HANDLE) {
+    vmaEndDefragmentationPass(allocator, mContext);
+    vmaDefragmentationEnd(allocator, mContext);
+    mContext = VK_NULL_HANDLE;
+  }
+  // Only now VMA allows the allocations of the pass to be queried and freed again
+  for (Move& move : mMoves) {
+    if (move.buffer != nullptr)
+      vmaGetAllocationInfo(allocator, move.buffer->mAllocation, &move.buffer->mAllocationInfo);
+    else if (move.image != nullptr)
+      vmaGetAllocationInfo(allocator, move.image->mAllocation, &move.image->mAllocationInfo);
+  }
+  mMoves.clear();
+  for (const Orphan& orphan : mOrphans) {
+    mAllocator.untrack(orphan.allocation, orphan.category);
+    if (orphan.buffer)
+      vmaDestroyBuffer(allocator, orphan.buffer, orphan.allocation);
+    else if (orphan.image)
+      vmaDestroyImage(allocator, orphan.image, orphan.allocation);
+    else
+      vmaFreeMemory(allocator, orphan.allocation);
+  }
+  mOrphans.clear();
+
+  mStats.bytesMoved += mPassStats.bytesMoved;
+  mStats.bytesFreed += mPassStats.bytesFreed;
+  mStats.allocationsMoved += mPassStats.allocationsMoved;
+  mStats.deviceMemoryBlocksFreed += mPassStats.deviceMemoryBlocksFreed;
+  mPassStats = {};
+  mState = State::Idle;
+}
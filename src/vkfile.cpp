@@ -0,0 +1,81 @@
+#include "vkfile.hpp"
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+vw::MappedFile::MappedFile(const std::filesystem::path& path, FileAccess access) {
+  if (!std::filesystem::exists(path))
+    throw std::runtime_error("File " + path.string() + " does not exist!");
+  if (!std::filesystem::is_regular_file(path))
+    throw std::runtime_error("File " + path.string() + " is not a regular file!");
+
+  mSize = std::filesystem::file_size(path);
+  if (mSize == 0)
+    return;
+
+#ifdef _WIN32
+  DWORD flags = (access == FileAccess::Sequential) ? FILE_FLAG_SEQUENTIAL_SCAN : 0;
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    throw std::runtime_error("Could not open file " + path.string());
+  // The mapping and the view keep their parent objects alive, so both handles can be closed right away
+  HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr)
+    throw std::runtime_error("Could not create file mapping for " + path.string());
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (view == nullptr)
+    throw std::runtime_error("Could not map file " + path.string());
+  if (access == FileAccess::Sequential && mSize >= kPrefetchThreshold) {
+    WIN32_MEMORY_RANGE_ENTRY range{view, mSize};
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+  }
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Could not open file " + path.string());
+  void* view = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (view == MAP_FAILED)
+    throw std::runtime_error("Could not map file " + path.string());
+  // Only hints, a failure just leaves the default read-ahead in place
+  if (access == FileAccess::Sequential) {
+    madvise(view, mSize, MADV_SEQUENTIAL);
+    if (mSize >= kPrefetchThreshold)
+      madvise(view, mSize, MADV_WILLNEED);
+  }
+#endif
+  mData = static_cast<const std::byte*>(view);
+}
+
+vw::MappedFile::~MappedFile() {
+  unmap();
+}
+
+vw::MappedFile::MappedFile(MappedFile&& other) noexcept : mData{std::exchange(other.mData, nullptr)}, mSize{std::exchange(other.mSize, 0)} {}
+
+vw::MappedFile& vw::MappedFile::operator=(MappedFile&& other) noexcept {
+  unmap();
+  mData = std::exchange(other.mData, nullptr);
+  mSize = std::exchange(other.mSize, 0);
+  return *this;
+}
+
+void vw::MappedFile::unmap() {
+  if (mData == nullptr)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(mData);
+#else
+  munmap(const_cast<std::byte*>(mData), mSize);
+#endif
+  mData = nullptr;
+}
@@ -1,6 +1,11 @@
 #define VMA_IMPLEMENTATION
 #include "..\inc\vkmemory.hpp"
+#include <algorithm>
+#include <cstring>
 #include <exception>
+#include <fstream>
+#include <json.hpp>
+#include "vkdefrag.hpp"
 #include "vulkan/vulkan.hpp"
 
 int32_t findProperties(const vk::PhysicalDeviceMemoryProperties& memoryProperties,
@@ -18,8 +23,12 @@ int32_t findProperties(const vk::PhysicalDeviceMemoryProperties& memoryPropertie
   return -1;
 }
 
-vw::Buffer::Buffer(MemoryAllocator& allocator, vw::ArrayProxy<vk::DeviceSize> segmentSizes, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage)
-    : mSegmentSizes{segmentSizes.size()}, mSegmentBase{segmentSizes.size()}, mAllocator{allocator.getHandle()} {
+vw::Buffer::Buffer(MemoryAllocator& allocator,
+                   vw::ArrayProxy<vk::DeviceSize> segmentSizes,
+                   vk::BufferUsageFlags usage,
+                   VmaMemoryUsage memoryUsage,
+                   bool directUpload)
+    : mSegmentSizes{segmentSizes.size()}, mSegmentBase{segmentSizes.size()}, mMemoryAllocator{allocator}, mAllocator{allocator.getHandle()} {
   constexpr vk::DeviceSize cAlign = 256;
   vk::DeviceSize nextSegmentBase = 0;
   for (const auto& v : segmentSizes) {
@@ -33,26 +42,52 @@ vw::Buffer::Buffer(MemoryAllocator& allocator, vw::ArrayProxy<vk::DeviceSize> se
 
   VmaAllocationCreateInfo allocationCreateInfo{};
   allocationCreateInfo.usage = memoryUsage;
-  if (memoryUsage == VMA_MEMORY_USAGE_CPU_TO_GPU)
+  allocationCreateInfo.flags = VMA_ALLOCATION_CREATE_USER_DATA_COPY_STRING_BIT;
+  if (memoryUsage == VMA_MEMORY_USAGE_CPU_TO_GPU || memoryUsage == VMA_MEMORY_USAGE_GPU_TO_CPU)
     allocationCreateInfo.flags |= VMA_ALLOCATION_CREATE_MAPPED_BIT;
 
   VkBuffer buffer;
-  VkResult r = vmaCreateBuffer(mAllocator, &static_cast<VkBufferCreateInfo>(bufferCreateInfo), &allocationCreateInfo, &buffer, &mAllocation, &mAllocationInfo);
+  VkResult r = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  if (directUpload) {
+    VmaAllocationCreateInfo directCreateInfo{};
+    directCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT | VMA_ALLOCATION_CREATE_USER_DATA_COPY_STRING_BIT;
+    directCreateInfo.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    r = mMemoryAllocator.createBuffer(bufferCreateInfo, directCreateInfo, buffer, mAllocation, mAllocationInfo);
+  }
+  if (r != VK_SUCCESS)
+    r = mMemoryAllocator.createBuffer(bufferCreateInfo, allocationCreateInfo, buffer, mAllocation, mAllocationInfo);
   if (r != VK_SUCCESS)
     throw std::runtime_error("Failed to create buffer");
 
   mHandle = buffer;
   mMappedPtr = reinterpret_cast<std::byte*>(mAllocationInfo.pMappedData);
+  mCreateInfo = bufferCreateInfo;
+  mMemoryAllocator.track(mAllocation, mCategory);
 }
 
 vw::Buffer::~Buffer() {
-  if (mHandle)
+  // Takes over the allocation while a defragmentation pass is open
+  if (mDefragmenter != nullptr)
+    mDefragmenter->remove(*this);
+  if (mHandle) {
+    mMemoryAllocator.untrack(mAllocation, mCategory);
     vmaDestroyBuffer(mAllocator, mHandle, mAllocation);
+    // Already destroyed with the allocation
+    mHandle = nullptr;
+  }
+}
+
+void vw::Buffer::setDebugInfo(MemoryCategory category, const std::string& name) {
+  mMemoryAllocator.untrack(mAllocation, mCategory);
+  mCategory = category;
+  mMemoryAllocator.track(mAllocation, mCategory);
+  vmaSetAllocationUserData(mAllocator, mAllocation, name.empty() ? nullptr : const_cast<char*>(name.c_str()));
 }
 
 const static std::unordered_map<vk::ImageLayout, vk::AccessFlags> MAP_LAYOUT_TO_ACCESS_FLAGS{
     {vk::ImageLayout::eUndefined, {}},
     {vk::ImageLayout::eTransferDstOptimal, vk::AccessFlagBits::eTransferWrite},
+    {vk::ImageLayout::eTransferSrcOptimal, vk::AccessFlagBits::eTransferRead},
     {vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eShaderRead},
     {vk::ImageLayout::eDepthStencilAttachmentOptimal, vk::AccessFlagBits::eDepthStencilAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentRead},
     {vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite},
@@ -61,6 +96,7 @@ const static std::unordered_map<vk::ImageLayout, vk::AccessFlags> MAP_LAYOUT_TO_
 const static std::unordered_map<vk::ImageLayout, vk::PipelineStageFlags> MAP_LAYOUT_TO_STAGE{
     {vk::ImageLayout::eUndefined, vk::PipelineStageFlagBits::eTopOfPipe},
     {vk::ImageLayout::eTransferDstOptimal, vk::PipelineStageFlagBits::eTransfer},
+    {vk::ImageLayout::eTransferSrcOptimal, vk::PipelineStageFlagBits::eTransfer},
     {vk::ImageLayout::eShaderReadOnlyOptimal, vk::PipelineStageFlagBits::eFragmentShader},
     {vk::ImageLayout::eDepthStencilAttachmentOptimal, vk::PipelineStageFlagBits::eEarlyFragmentTests},
     {vk::ImageLayout::eGeneral, vk::PipelineStageFlagBits::eComputeShader},
@@ -75,7 +111,7 @@ vw::Image::Image(MemoryAllocator& allocator,
                  uint32_t mipLevels,
                  uint32_t arrayLayers,
                  VmaMemoryUsage memoryUsage)
-    : mExtent{extent}, mFormat{format}, mAllocator{allocator.getHandle()} {
+    : mMemoryAllocator{allocator}, mAllocator{allocator.getHandle()} {
   vk::ImageCreateInfo createInfo;
   createInfo.imageType = type;
   createInfo.format = format;
@@ -89,35 +125,49 @@ vw::Image::Image(MemoryAllocator& allocator,
 
   VmaAllocationCreateInfo allocationCreateInfo{};
   allocationCreateInfo.usage = memoryUsage;
+  allocationCreateInfo.flags = VMA_ALLOCATION_CREATE_USER_DATA_COPY_STRING_BIT;
   if (memoryUsage == VMA_MEMORY_USAGE_CPU_TO_GPU)
     allocationCreateInfo.flags |= VMA_ALLOCATION_CREATE_MAPPED_BIT;
 
   VkImage image;
-  VkResult r = vmaCreateImage(mAllocator, &static_cast<VkImageCreateInfo>(createInfo), &allocationCreateInfo, &image, &mAllocation, &mAllocationInfo);
+  VkResult r = mMemoryAllocator.createImage(createInfo, allocationCreateInfo, image, mAllocation, mAllocationInfo);
   if (r != VK_SUCCESS)
     throw std::runtime_error("Failed to create image");
 
   mHandle = image;
+  mCreateInfo = createInfo;
+  mMemoryAllocator.track(mAllocation, mCategory);
 }
 
 vw::Image::~Image() {
-  if (mHandle)
+  if (mDefragmenter != nullptr)
+    mDefragmenter->remove(*this);
+  if (mHandle) {
+    mMemoryAllocator.untrack(mAllocation, mCategory);
     vmaDestroyImage(mAllocator, mHandle, mAllocation);
+    mHandle = nullptr;
+  }
 }
 
-void vw::Image::transitionLayout(vk::CommandBuffer cmdBuffer,
-                                 vk::Image image,
-                                 vk::ImageLayout oldLayout,
-                                 vk::ImageLayout newLayout,
-                                 vk::ImageSubresourceRange range) {
-  vk::ImageMemoryBarrier barrier;
-  vk::PipelineStageFlags srcStageMask, dstStageMask;
+void vw::Image::setDebugInfo(MemoryCategory category, const std::string& name) {
+  mMemoryAllocator.untrack(mAllocation, mCategory);
+  mCategory = category;
+  mMemoryAllocator.track(mAllocation, mCategory);
+  vmaSetAllocationUserData(mAllocator, mAllocation, name.empty() ? nullptr : const_cast<char*>(name.c_str()));
+}
 
+vk::ImageMemoryBarrier vw::Image::getLayoutBarrier(vk::Image image,
+                                                   vk::ImageLayout oldLayout,
+                                                   vk::ImageLayout newLayout,
+                                                   vk::ImageSubresourceRange range,
+                                                   vk::PipelineStageFlags& srcStages,
+                                                   vk::PipelineStageFlags& dstStages) {
+  vk::ImageMemoryBarrier barrier;
   try {
     barrier.srcAccessMask = MAP_LAYOUT_TO_ACCESS_FLAGS.at(oldLayout);
     barrier.dstAccessMask = MAP_LAYOUT_TO_ACCESS_FLAGS.at(newLayout);
-    srcStageMask = MAP_LAYOUT_TO_STAGE.at(oldLayout);
-    dstStageMask = MAP_LAYOUT_TO_STAGE.at(newLayout);
+    srcStages |= MAP_LAYOUT_TO_STAGE.at(oldLayout);
+    dstStages |= MAP_LAYOUT_TO_STAGE.at(newLayout);
   } catch (std::out_of_range&) {
     throw std::runtime_error("Unsupported layout transition!");
   }
@@ -126,7 +176,16 @@ void vw::Image::transitionLayout(vk::CommandBuffer cmdBuffer,
   barrier.newLayout = newLayout;
   barrier.image = image;
   barrier.subresourceRange = range;
+  return barrier;
+}
 
+void vw::Image::transitionLayout(vk::CommandBuffer cmdBuffer,
+                                 vk::Image image,
+                                 vk::ImageLayout oldLayout,
+                                 vk::ImageLayout newLayout,
+                                 vk::ImageSubresourceRange range) {
+  vk::PipelineStageFlags srcStageMask, dstStageMask;
+  vk::ImageMemoryBarrier barrier = getLayoutBarrier(image, oldLayout, newLayout, range, srcStageMask, dstStageMask);
   cmdBuffer.pipelineBarrier(srcStageMask, dstStageMask, {}, {}, {}, barrier);
 }
 
@@ -156,7 +215,7 @@ vw::ImageView vw::Image::createView(vk::ImageViewType viewType, vk::ImageSubreso
   vk::ImageViewCreateInfo createInfo;
   createInfo.image = mHandle;
   createInfo.viewType = viewType;
-  createInfo.format = mFormat;
+  createInfo.format = mCreateInfo.format;
   createInfo.components = components;
   createInfo.subresourceRange = range;
   return vw::ImageView{vw::g::device.createImageView(createInfo)};
@@ -166,21 +225,507 @@ vw::ImageView::ImageView(vk::ImageView handle) {
   mHandle = handle;
 }
 
-vw::MemoryAllocator::MemoryAllocator() {
+vw::StagingBuffer::StagingBuffer(MemoryAllocator& allocator, vk::DeviceSize size, vw::Queue& transferQueue, vw::Queue* mipQueue, uint32_t regionCount)
+    : vw::Buffer{allocator, size, vw::BufferUse::kStagingBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU},
+      mTransferQueue{transferQueue},
+      mMipQueue{mipQueue},
+      mRegionSize{(regionCount > 0) ? (size / regionCount) & ~vk::DeviceSize{15} : 0},
+      mRegionFences(regionCount) {
+  if (mRegionSize == 0)
+    throw std::runtime_error("Staging buffer is too small for " + std::to_string(regionCount) + " regions");
+  setDebugInfo(MemoryCategory::Staging, "StagingBuffer");
+}
+
+vw::StagingBuffer::~StagingBuffer() {
+  // The buffer must outlive the copies that read from it
+  wait();
+}
+
+bool vw::StagingBuffer::canGenerateMips(vk::Format format) const {
+  if (mMipQueue == nullptr)
+    return false;
+  constexpr vk::FormatFeatureFlags kRequiredFeatures =
+      vk::FormatFeatureFlagBits::eBlitSrc | vk::FormatFeatureFlagBits::eBlitDst | vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+  return (vw::g::physicalDevice.getFormatProperties(format).optimalTilingFeatures & kRequiredFeatures) == kRequiredFeatures;
+}
+
+void vw::StagingBuffer::flush() {
+  if (mStagedBufferCopies.empty() && mStagedImageCopies.empty())
+    return;
+  bool useMipQueue = std::any_of(mStagedImageCopies.begin(), mStagedImageCopies.end(), [](const auto& copy) { return copy.useMipQueue; });
+  vw::Queue& queue = useMipQueue ? *mMipQueue : mTransferQueue;
+  mRegionFences[mRegion] = queue.oneTimeRecordSubmit([&](vw::CommandBuffer& cmdBuffer) {
+    for (const auto& copy : mStagedBufferCopies) {
+      cmdBuffer.copyBuffer(mHandle, copy.dst, copy.bufferCopy);
+    }
+    recordImageCopies(cmdBuffer);
+  });
+  mStagedBufferCopies.clear();
+  mStagedImageCopies.clear();
+
+  // The next region is only written once the GPU is done reading its previous contents
+  mRegion = (mRegion + 1) % vw::size32(mRegionFences);
+  mUsedBytes = mRegion * mRegionSize;
+  if (auto& fence = mRegionFences[mRegion]) {
+    fence->wait();
+    fence.reset();
+  }
+}
+
+void vw::StagingBuffer::wait() {
+  for (auto& fence : mRegionFences) {
+    if (fence) {
+      fence->wait();
+      fence.reset();
+    }
+  }
+}
+
+vk::DeviceSize vw::StagingBuffer::getStagedImageSize(const ImageFile& imageFile) {
+  const vk::DeviceSize alignment = getImageOffsetAlignment(imageFile.getFormat());
+  vk::DeviceSize size = 0;
+  for (uint32_t layer = 0; layer < imageFile.getArrayLayers(); ++layer) {
+    for (uint32_t mip = 0; mip < imageFile.getMipLevels(); ++mip)
+      size = alignImageOffset(size, alignment) + imageFile.getSubresourceSize(mip);
+  }
+  return size;
+}
+
+void vw::StagingBuffer::loadStagedImage(const ImageFile& imageFile, std::byte* dst) {
+  imageFile.loadData(dst);
+  const vk::DeviceSize alignment = getImageOffsetAlignment(imageFile.getFormat());
+  struct Subresource {
+    vk::DeviceSize packedOffset, stagedOffset, size;
+  };
+  std::vector<Subresource> subresources;
+  vk::DeviceSize packedOffset = 0, stagedOffset = 0;
+  for (uint32_t layer = 0; layer < imageFile.getArrayLayers(); ++layer) {
+    for (uint32_t mip = 0; mip < imageFile.getMipLevels(); ++mip) {
+      vk::DeviceSize size = imageFile.getSubresourceSize(mip);
+      stagedOffset = alignImageOffset(stagedOffset, alignment);
+      subresources.push_back({packedOffset, stagedOffset, size});
+      packedOffset += size;
+      stagedOffset += size;
+    }
+  }
+  // Staged offsets are never below the packed ones, moving from the back never overwrites data that still has to move
+  for (auto it = subresources.rbegin(); it != subresources.rend(); ++it) {
+    if (it->stagedOffset != it->packedOffset)
+      std::memmove(dst + it->stagedOffset, dst + it->packedOffset, it->size);
+  }
+}
+
+void vw::StagingBuffer::queueImageCopyInBands(const ImageFile& imageFile,
+                                              vk::Image dst,
+                                              vk::ImageLayout preLayout,
+                                              vk::ImageLayout postLayout,
+                                              vk::ImageSubresourceLayers layers,
+                                              vk::Offset3D destOffset,
+                                              uint32_t generatedMipLevels) {
+  if (generatedMipLevels > 0 && (!canGenerateMips(imageFile.getFormat()) || destOffset != vk::Offset3D{}))
+    throw std::runtime_error("Mips can not be generated for this image upload");
+  if (imageFile.getExtent().depth > 1)
+    throw std::runtime_error("3D images larger than a staging region can not be uploaded");
+  // Mapped and in-memory files copy every band straight into the region. Files that only decode as a whole (GenericImageFile) are loaded
+  // into a temporary first, which costs dataSize() bytes of extra peak memory for the duration of the upload
+  std::vector<std::byte> decoded;
+  if (!imageFile.hasRangedLoad()) {
+    decoded.resize(imageFile.dataSize());
+    imageFile.loadData(decoded.data());
+  }
+  auto loadBand = [&](vk::DeviceSize offset, vk::DeviceSize size, std::byte* bandDst) {
+    if (decoded.empty())
+      imageFile.loadRange(offset, size, bandDst);
+    else
+      std::memcpy(bandDst, decoded.data() + offset, size);
+  };
+
+  // Each flush holds at most one band copy of the image, bands in between stay in TransferDstOptimal and only the last one applies
+  // postLayout and generates the mips. The bands get flushes of their own, so they all go to the same queue and run in order
+  flush();
+  const vw::FormatBlock block = vw::getFormatBlock(imageFile.getFormat());
+  const vk::DeviceSize alignment = getImageOffsetAlignment(imageFile.getFormat());
+  const vk::ImageSubresourceRange range{layers.aspectMask, layers.mipLevel, imageFile.getMipLevels() + generatedMipLevels, layers.baseArrayLayer,
+                                        imageFile.getArrayLayers()};
+  StagedImageCopy* staged = nullptr;
+  vk::ImageLayout bandPreLayout = preLayout;
+  vk::DeviceSize srcOffset = 0;
+  for (uint32_t layer = 0; layer < imageFile.getArrayLayers(); ++layer) {
+    for (uint32_t mip = 0; mip < imageFile.getMipLevels(); ++mip) {
+      const vk::Extent3D extent = vw::getMipExtent(imageFile.getExtent(), mip);
+      const uint32_t blockRows = (extent.height + block.height - 1) / block.height;
+      const vk::DeviceSize rowPitch = vk::DeviceSize{(extent.width + block.width - 1) / block.width} * block.size;
+      if (rowPitch + alignment - 16 > mRegionSize)
+        throw std::runtime_error("Image row exceeds staging region size");
+      for (uint32_t row = 0; row < blockRows;) {
+        if (alignImageOffset(mUsedBytes, alignment) + rowPitch > regionEnd()) {
+          flush();
+          staged = nullptr;
+          bandPreLayout = vk::ImageLayout::eTransferDstOptimal;
+        }
+        mUsedBytes = alignImageOffset(mUsedBytes, alignment);
+        if (staged == nullptr) {
+          staged = &mStagedImageCopies.emplace_back();
+          staged->dst = dst;
+          staged->preLayout = bandPreLayout;
+          staged->postLayout = vk::ImageLayout::eTransferDstOptimal;
+          staged->range = range;
+          staged->extent = imageFile.getExtent();
+          staged->generatedMipLevels = 0;
+          staged->useMipQueue = generatedMipLevels > 0;
+        }
+        const uint32_t rowCount = static_cast<uint32_t>(std::min<vk::DeviceSize>(blockRows - row, (regionEnd() - mUsedBytes) / rowPitch));
+        vk::BufferImageCopy& copyInfo = staged->regions.emplace_back();
+        copyInfo.bufferOffset = mUsedBytes;
+        copyInfo.imageOffset = vk::Offset3D{destOffset.x >> mip, (destOffset.y >> mip) + static_cast<int32_t>(row * block.height), destOffset.z >> mip};
+        copyInfo.imageExtent = vk::Extent3D{extent.width, std::min(rowCount * block.height, extent.height - row * block.height), 1};
+        copyInfo.imageSubresource = vk::ImageSubresourceLayers{layers.aspectMask, layers.mipLevel + mip, layers.baseArrayLayer + layer, 1};
+        loadBand(srcOffset + row * rowPitch, rowCount * rowPitch, mMappedPtr + mUsedBytes);
+        mUsedBytes += rowCount * rowPitch;
+        row += rowCount;
+      }
+      srcOffset += imageFile.getSubresourceSize(mip);
+    }
+  }
+  staged->postLayout = postLayout;
+  staged->generatedMipLevels = generatedMipLevels;
+  flush();
+}
+
+vw::FrameAllocator::FrameAllocator(MemoryAllocator& allocator, vk::DeviceSize frameSize, uint32_t frameCount, vk::BufferUsageFlags usage)
+    : vw::Buffer{allocator, std::vector<vk::DeviceSize>(frameCount, frameSize), usage, VMA_MEMORY_USAGE_CPU_TO_GPU}, mFrameFences(frameCount) {
+  const vk::PhysicalDeviceLimits limits = vw::g::physicalDevice.getProperties().limits;
+  mOffsetAlignment = std::max(limits.minUniformBufferOffsetAlignment, limits.minStorageBufferOffsetAlignment);
+  // Every frame starts one past the last, beginning with slot 0
+  mFrame = frameCount - 1;
+  setDebugInfo(MemoryCategory::FrameData, "FrameAllocator");
+}
+
+void vw::FrameAllocator::beginFrame() {
+  mFrame = (mFrame + 1) % vw::size32(mFrameFences);
+  mUsedBytes = 0;
+  if (auto& fence = mFrameFences[mFrame]) {
+    fence->wait();
+    fence.reset();
+  }
+}
+
+void vw::FrameAllocator::endFrame(std::shared_ptr<vw::Fence> fence) {
+  mFrameFences[mFrame] = std::move(fence);
+}
+
+vw::FrameAllocator::Allocation vw::FrameAllocator::allocate(vk::DeviceSize size) {
+  vk::DeviceSize offset = (mUsedBytes + mOffsetAlignment - 1) / mOffsetAlignment * mOffsetAlignment;
+  if (offset + size > mSegmentSizes[mFrame])
+    throw std::runtime_error("Frame allocator is out of space, " + std::to_string(mSegmentSizes[mFrame]) + " bytes per frame");
+  mUsedBytes = offset + size;
+  offset += mSegmentBase[mFrame];
+  return {mMappedPtr + offset, static_cast<uint32_t>(offset)};
+}
+
+void vw::StagingBuffer::recordImageCopies(vk::CommandBuffer cmdBuffer) const {
+  std::vector<vk::ImageMemoryBarrier> barriers;
+  vk::PipelineStageFlags srcStages, dstStages;
+  auto recordBarriers = [&]() {
+    if (!barriers.empty())
+      cmdBuffer.pipelineBarrier(srcStages, dstStages, {}, {}, {}, barriers);
+    barriers.clear();
+    srcStages = dstStages = {};
+  };
+  // The first level to generate is blitted from the last one that came with the file
+  auto firstSourceLevel = [](const StagedImageCopy& copy) { return copy.range.baseMipLevel + copy.range.levelCount - copy.generatedMipLevels - 1; };
+
+  for (const auto& copy : mStagedImageCopies)
+    barriers.push_back(vw::Image::getLayoutBarrier(copy.dst, copy.preLayout, vk::ImageLayout::eTransferDstOptimal, copy.range, srcStages, dstStages));
+  recordBarriers();
+  uint32_t maxGeneratedMipLevels = 0;
+  for (const auto& copy : mStagedImageCopies) {
+    cmdBuffer.copyBufferToImage(mHandle, copy.dst, vk::ImageLayout::eTransferDstOptimal, copy.regions);
+    maxGeneratedMipLevels = std::max(maxGeneratedMipLevels, copy.generatedMipLevels);
+  }
+
+  // Every image of the batch advances one level per step, so each step needs a single barrier
+  for (uint32_t step = 0; step < maxGeneratedMipLevels; ++step) {
+    for (const auto& copy : mStagedImageCopies) {
+      if (step >= copy.generatedMipLevels)
+        continue;
+      vk::ImageSubresourceRange srcRange{copy.range.aspectMask, firstSourceLevel(copy) + step, 1, copy.range.baseArrayLayer, copy.range.layerCount};
+      barriers.push_back(
+          vw::Image::getLayoutBarrier(copy.dst, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eTransferSrcOptimal, srcRange, srcStages, dstStages));
+    }
+    recordBarriers();
+    for (const auto& copy : mStagedImageCopies) {
+      if (step >= copy.generatedMipLevels)
+        continue;
+      uint32_t srcLevel = firstSourceLevel(copy) + step;
+      vk::Extent3D srcExtent = vw::getMipExtent(copy.extent, srcLevel - copy.range.baseMipLevel);
+      vk::Extent3D dstExtent = vw::getMipExtent(copy.extent, srcLevel + 1 - copy.range.baseMipLevel);
+      vk::ImageBlit blit;
+      blit.srcSubresource = vk::ImageSubresourceLayers{copy.range.aspectMask, srcLevel, copy.range.baseArrayLayer, copy.range.layerCount};
+      blit.srcOffsets[1] = vk::Offset3D{static_cast<int32_t>(srcExtent.width), static_cast<int32_t>(srcExtent.height), static_cast<int32_t>(srcExtent.depth)};
+      blit.dstSubresource = vk::ImageSubresourceLayers{copy.range.aspectMask, srcLevel + 1, copy.range.baseArrayLayer, copy.range.layerCount};
+      blit.dstOffsets[1] = vk::Offset3D{static_cast<int32_t>(dstExtent.width), static_cast<int32_t>(dstExtent.height), static_cast<int32_t>(dstExtent.depth)};
+      cmdBuffer.blitImage(copy.dst, vk::ImageLayout::eTransferSrcOptimal, copy.dst, vk::ImageLayout::eTransferDstOptimal, blit, vk::Filter::eLinear);
+    }
+  }
+
+  // Blit sources are left in TransferSrc, the levels copied above them and the last generated level in TransferDst
+  for (const auto& copy : mStagedImageCopies) {
+    if (copy.generatedMipLevels == 0) {
+      barriers.push_back(vw::Image::getLayoutBarrier(copy.dst, vk::ImageLayout::eTransferDstOptimal, copy.postLayout, copy.range, srcStages, dstStages));
+      continue;
+    }
+    vk::ImageSubresourceRange range = copy.range;
+    uint32_t sourceLevel = firstSourceLevel(copy);
+    if (sourceLevel > copy.range.baseMipLevel) {
+      range.baseMipLevel = copy.range.baseMipLevel;
+      range.levelCount = sourceLevel - copy.range.baseMipLevel;
+      barriers.push_back(vw::Image::getLayoutBarrier(copy.dst, vk::ImageLayout::eTransferDstOptimal, copy.postLayout, range, srcStages, dstStages));
+    }
+    range.baseMipLevel = sourceLevel;
+    range.levelCount = copy.generatedMipLevels;
+    barriers.push_back(vw::Image::getLayoutBarrier(copy.dst, vk::ImageLayout::eTransferSrcOptimal, copy.postLayout, range, srcStages, dstStages));
+    range.baseMipLevel = sourceLevel + copy.generatedMipLevels;
+    range.levelCount = 1;
+    barriers.push_back(vw::Image::getLayoutBarrier(copy.dst, vk::ImageLayout::eTransferDstOptimal, copy.postLayout, range, srcStages, dstStages));
+  }
+  recordBarriers();
+}
+
+const char* vw::toString(MemoryCategory category) {
+  switch (category) {
+    case MemoryCategory::Geometry:
+      return "Geometry";
+    case MemoryCategory::SceneData:
+      return "SceneData";
+    case MemoryCategory::Texture:
+      return "Texture";
+    case MemoryCategory::RenderTarget:
+      return "RenderTarget";
+    case MemoryCategory::Staging:
+      return "Staging";
+    case MemoryCategory::FrameData:
+      return "FrameData";
+    default:
+      return "Other";
+  }
+}
+
+vw::MemoryAllocator::MemoryAllocator(bool memoryBudget, uint32_t allocationStripes) : mStripes(allocationStripes) {
   VmaAllocatorCreateInfo createInfo{};
   createInfo.instance = vw::g::instance;
   createInfo.physicalDevice = vw::g::physicalDevice;
   createInfo.device = vw::g::device;
   createInfo.vulkanApiVersion = VK_API_VERSION_1_2;
 
-  createInfo.flags |= VMA_ALLOCATOR_CREATE_EXTERNALLY_SYNCHRONIZED_BIT;
+  if (allocationStripes == 0)
+    createInfo.flags |= VMA_ALLOCATOR_CREATE_EXTERNALLY_SYNCHRONIZED_BIT;
+  if (memoryBudget)
+    createInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
 
   VkResult r = vmaCreateAllocator(&createInfo, &mHandle);
   if (r != VK_SUCCESS)
     throw std::runtime_error("Failed to create MemoryAllocator");
+
+  const VkPhysicalDeviceMemoryProperties* memoryProperties = nullptr;
+  vmaGetMemoryProperties(mHandle, &memoryProperties);
+  for (uint32_t i = 0; i < memoryProperties->memoryTypeCount; ++i)
+    mMemoryTypeHeaps.push_back(memoryProperties->memoryTypes[i].heapIndex);
+  // The atomic counters can not be moved, so the vector is built at its final size
+  mHeapUsage = decltype(mHeapUsage)(memoryProperties->memoryHeapCount);
+  for (Stripe& stripe : mStripes)
+    stripe.pools.resize(memoryProperties->memoryTypeCount, VK_NULL_HANDLE);
 }
 
 vw::MemoryAllocator::~MemoryAllocator() {
+  for (Stripe& stripe : mStripes) {
+    for (VmaPool pool : stripe.pools) {
+      if (pool != VK_NULL_HANDLE)
+        vmaDestroyPool(mHandle, pool);
+    }
+  }
   if (mHandle)
     vmaDestroyAllocator(mHandle);
+}
+
+VkResult vw::MemoryAllocator::selectStripePool(uint32_t memoryTypeBits, VmaAllocationCreateInfo& allocationInfo, uint32_t& memoryTypeIndex) {
+  VkResult r = vmaFindMemoryTypeIndex(mHandle, memoryTypeBits, &allocationInfo, &memoryTypeIndex);
+  if (r != VK_SUCCESS)
+    return r;
+
+  // Threads are spread over the stripes round robin in the order they first allocate
+  static std::atomic<uint32_t> nextThreadIndex{0};
+  thread_local const uint32_t threadIndex = nextThreadIndex++;
+  Stripe& stripe = mStripes[threadIndex % mStripes.size()];
+  std::lock_guard<std::mutex> lock{stripe.mutex};
+  VmaPool& pool = stripe.pools[memoryTypeIndex];
+  if (pool == VK_NULL_HANDLE) {
+    VmaPoolCreateInfo poolInfo{};
+    poolInfo.memoryTypeIndex = memoryTypeIndex;
+    r = vmaCreatePool(mHandle, &poolInfo, &pool);
+    if (r != VK_SUCCESS)
+      return r;
+  }
+  allocationInfo.pool = pool;
+  return VK_SUCCESS;
+}
+
+template <typename AllocateFunc>
+VkResult vw::MemoryAllocator::allocateFromStripe(uint32_t memoryTypeBits, VmaAllocationCreateInfo& allocationInfo, AllocateFunc allocate) {
+  // Custom pools are bound to one memory type, so the next best type is tried by hand when a pool runs out, the way VMA does for its
+  // default pools
+  VkResult r = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  while (memoryTypeBits != 0) {
+    uint32_t memoryTypeIndex = 0;
+    r = selectStripePool(memoryTypeBits, allocationInfo, memoryTypeIndex);
+    if (r != VK_SUCCESS)
+      return r;
+    r = allocate(allocationInfo);
+    if (r != VK_ERROR_OUT_OF_DEVICE_MEMORY)
+      return r;
+    memoryTypeBits &= ~(1u << memoryTypeIndex);
+  }
+  return r;
+}
+
+VkResult vw::MemoryAllocator::createBuffer(const vk::BufferCreateInfo& bufferInfo,
+                                           VmaAllocationCreateInfo allocationInfo,
+                                           VkBuffer& buffer,
+                                           VmaAllocation& allocation,
+                                           VmaAllocationInfo& info) {
+  if (mStripes.empty())
+    return vmaCreateBuffer(mHandle, &static_cast<const VkBufferCreateInfo&>(bufferInfo), &allocationInfo, &buffer, &allocation, &info);
+
+  // The memory type bits of the handle pick the stripe's pool
+  vk::Buffer handle = vw::g::device.createBuffer(bufferInfo);
+  VkResult r = allocateFromStripe(vw::g::device.getBufferMemoryRequirements(handle).memoryTypeBits, allocationInfo, [&](const VmaAllocationCreateInfo& poolInfo) {
+    return vmaAllocateMemoryForBuffer(mHandle, handle, &poolInfo, &allocation, &info);
+  });
+  if (r == VK_SUCCESS) {
+    r = vmaBindBufferMemory(mHandle, allocation, handle);
+    if (r != VK_SUCCESS)
+      vmaFreeMemory(mHandle, allocation);
+  }
+  if (r != VK_SUCCESS) {
+    vw::g::device.destroyBuffer(handle);
+    return r;
+  }
+  buffer = handle;
+  return VK_SUCCESS;
+}
+
+VkResult vw::MemoryAllocator::createImage(const vk::ImageCreateInfo& imageInfo,
+                                          VmaAllocationCreateInfo allocationInfo,
+                                          VkImage& image,
+                                          VmaAllocation& allocation,
+                                          VmaAllocationInfo& info) {
+  if (mStripes.empty())
+    return vmaCreateImage(mHandle, &static_cast<const VkImageCreateInfo&>(imageInfo), &allocationInfo, &image, &allocation, &info);
+
+  vk::Image handle = vw::g::device.createImage(imageInfo);
+  VkResult r = allocateFromStripe(vw::g::device.getImageMemoryRequirements(handle).memoryTypeBits, allocationInfo, [&](const VmaAllocationCreateInfo& poolInfo) {
+    return vmaAllocateMemoryForImage(mHandle, handle, &poolInfo, &allocation, &info);
+  });
+  if (r == VK_SUCCESS) {
+    r = vmaBindImageMemory(mHandle, allocation, handle);
+    if (r != VK_SUCCESS)
+      vmaFreeMemory(mHandle, allocation);
+  }
+  if (r != VK_SUCCESS) {
+    vw::g::device.destroyImage(handle);
+    return r;
+  }
+  image = handle;
+  return VK_SUCCESS;
+}
+
+void vw::MemoryAllocator::track(VmaAllocation allocation, MemoryCategory category) {
+  VmaAllocationInfo info;
+  vmaGetAllocationInfo(mHandle, allocation, &info);
+  AtomicUsage& usage = mHeapUsage[mMemoryTypeHeaps[info.memoryType]][static_cast<size_t>(category)];
+  usage.allocationCount.fetch_add(1, std::memory_order_relaxed);
+  usage.bytes.fetch_add(info.size, std::memory_order_relaxed);
+}
+
+void vw::MemoryAllocator::untrack(VmaAllocation allocation, MemoryCategory category) {
+  VmaAllocationInfo info;
+  vmaGetAllocationInfo(mHandle, allocation, &info);
+  AtomicUsage& usage = mHeapUsage[mMemoryTypeHeaps[info.memoryType]][static_cast<size_t>(category)];
+  usage.allocationCount.fetch_sub(1, std::memory_order_relaxed);
+  usage.bytes.fetch_sub(info.size, std::memory_order_relaxed);
+}
+
+vw::MemoryAllocator::Usage vw::MemoryAllocator::getUsage(MemoryCategory category) const {
+  Usage total;
+  for (uint32_t heap = 0; heap < mHeapUsage.size(); ++heap) {
+    Usage usage = getUsage(category, heap);
+    total.allocationCount += usage.allocationCount;
+    total.bytes += usage.bytes;
+  }
+  return total;
+}
+
+vw::MemoryAllocator::Usage vw::MemoryAllocator::getUsage(MemoryCategory category, uint32_t heapIndex) const {
+  const AtomicUsage& usage = mHeapUsage[heapIndex][static_cast<size_t>(category)];
+  return {usage.allocationCount.load(std::memory_order_relaxed), usage.bytes.load(std::memory_order_relaxed)};
+}
+
+std::vector<VmaBudget> vw::MemoryAllocator::getHeapBudgets() const {
+  std::vector<VmaBudget> budgets(mHeapUsage.size());
+  vmaGetHeapBudgets(mHandle, budgets.data());
+  return budgets;
+}
+
+vw::MemoryAllocator::Fragmentation vw::MemoryAllocator::getFragmentation() const {
+  VmaStats stats;
+  vmaCalculateStats(mHandle, &stats);
+  Fragmentation fragmentation;
+  fragmentation.blockCount = stats.total.blockCount;
+  fragmentation.blockBytes = stats.total.usedBytes + stats.total.unusedBytes;
+  fragmentation.unusedBytes = stats.total.unusedBytes;
+  fragmentation.unusedRangeCount = stats.total.unusedRangeCount;
+  fragmentation.largestUnusedRange = (stats.total.unusedRangeCount > 0) ? stats.total.unusedRangeSizeMax : 0;
+  return fragmentation;
+}
+
+void vw::MemoryAllocator::setFrameIndex(uint32_t frameIndex) {
+  vmaSetCurrentFrameIndex(mHandle, frameIndex);
+}
+
+std::string vw::MemoryAllocator::getReportJson() const {
+  char* statsString = nullptr;
+  vmaBuildStatsString(mHandle, &statsString, VK_TRUE);
+  nlohmann::json report = nlohmann::json::parse(statsString);
+  vmaFreeStatsString(mHandle, statsString);
+
+  nlohmann::json& categories = report["Categories"];
+  for (size_t i = 0; i < static_cast<size_t>(MemoryCategory::MaxEnum); ++i) {
+    auto category = static_cast<MemoryCategory>(i);
+    Usage total = getUsage(category);
+    nlohmann::json& entry = categories[toString(category)];
+    entry["AllocationCount"] = total.allocationCount;
+    entry["Bytes"] = total.bytes;
+    for (uint32_t heap = 0; heap < mHeapUsage.size(); ++heap)
+      entry["HeapBytes"].push_back(getUsage(category, heap).bytes);
+  }
+  nlohmann::json& heapBudgets = report["HeapBudgets"];
+  for (const VmaBudget& budget : getHeapBudgets()) {
+    heapBudgets.push_back(
+        {{"BlockBytes", budget.blockBytes}, {"AllocationBytes", budget.allocationBytes}, {"Usage", budget.usage}, {"Budget", budget.budget}});
+  }
+  Fragmentation fragmentation = getFragmentation();
+  report["Fragmentation"] = {{"BlockCount", fragmentation.blockCount},
+                             {"BlockBytes", fragmentation.blockBytes},
+                             {"UnusedBytes", fragmentation.unusedBytes},
+                             {"UnusedRangeCount", fragmentation.unusedRangeCount},
+                             {"LargestUnusedRange", fragmentation.largestUnusedRange},
+                             {"Ratio", fragmentation.ratio()}};
+  return report.dump(2);
+}
+
+void vw::MemoryAllocator::writeReport(const std::filesystem::path& path) const {
+  std::ofstream file{path, std::ios::trunc};
+  if (!file)
+    throw std::runtime_error("Could not create memory report " + path.string());
+  file << getReportJson();
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include "vkmeshlet.hpp"
+#include <algorithm>
+#include <cmath>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+
+namespace {
+constexpr uint8_t kNotInMeshlet = 0xff;
+static_assert(vw::kMaxMeshletVertices < kNotInMeshlet);
+
+// Ritter's approximate bounding sphere
+void computeBoundingSphere(const vw::MeshletData& data, vw::ArrayProxy<vw::Vec3> positions, vw::Meshlet& meshlet) {
+  auto vertex = [&](uint32_t i) { return positions[data.vertices[meshlet.vertexOffset + i]]; };
+  auto farthestFrom = [&](const vw::Vec3& point) {
+    vw::Vec3 farthest = vertex(0);
+    float maxDistance = -1.0f;
+    for (uint32_t i = 0; i < meshlet.vertexCount; ++i) {
+      float distance = glm::length(vertex(i) - point);
+      if (distance > maxDistance) {
+        maxDistance = distance;
+        farthest = vertex(i);
+      }
+    }
+    return farthest;
+  };
+  vw::Vec3 a = farthestFrom(vertex(0));
+  vw::Vec3 b = farthestFrom(a);
+  vw::Vec3 center = (a + b) * 0.5f;
+  float radius = glm::length(b - a) * 0.5f;
+  for (uint32_t i = 0; i < meshlet.vertexCount; ++i) {
+    vw::Vec3 p = vertex(i);
+    float distance = glm::length(p - center);
+    if (distance > radius) {
+      float newRadius = (radius + distance) * 0.5f;
+      center += (p - center) * ((newRadius - radius) / distance);
+      radius = newRadius;
+    }
+  }
+  meshlet.center = center;
+  meshlet.radius = radius;
+}
+
+void computeNormalCone(const vw::MeshletData& data, vw::ArrayProxy<vw::Vec3> positions, vw::Meshlet& meshlet) {
+  std::vector<vw::Vec3> normals;
+  std::vector<vw::Vec3> corners;
+  normals.reserve(meshlet.triangleCount);
+  corners.reserve(meshlet.triangleCount);
+  vw::Vec3 axis{0.0f};
+  for (uint32_t t = 0; t < meshlet.triangleCount; ++t) {
+    const uint8_t* tri = &data.triangles[meshlet.triangleOffset + 3 * t];
+    vw::Vec3 p0 = positions[data.vertices[meshlet.vertexOffset + tri[0]]];
+    vw::Vec3 p1 = positions[data.vertices[meshlet.vertexOffset + tri[1]]];
+    vw::Vec3 p2 = positions[data.vertices[meshlet.vertexOffset + tri[2]]];
+    vw::Vec3 normal = glm::cross(p1 - p0, p2 - p0);
+    float length = glm::length(normal);
+    if (length == 0.0f)
+      continue;
+    normals.push_back(normal / length);
+    corners.push_back(p0);
+    axis += normals.back();
+  }
+
+  // A cone wider than ~84 degrees can hardly ever cull the meshlet, it keeps the zero axis and cutoff of 1 that never culls
+  float axisLength = glm::length(axis);
+  if (axisLength == 0.0f)
+    return;
+  axis /= axisLength;
+  float minDot = 1.0f;
+  for (const vw::Vec3& normal : normals)
+    minDot = std::min(minDot, glm::dot(normal, axis));
+  if (minDot <= 0.1f)
+    return;
+
+  // Move the apex back along the axis until every triangle plane is in front of it
+  float maxT = 0.0f;
+  for (size_t i = 0; i < normals.size(); ++i) {
+    float dc = glm::dot(meshlet.center - corners[i], normals[i]);
+    float dn = glm::dot(axis, normals[i]);
+    maxT = std::max(maxT, dc / dn);
+  }
+  meshlet.coneApex = meshlet.center - axis * maxT;
+  meshlet.coneAxis = axis;
+  meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+}
+
+void finishMeshlet(vw::MeshletData& data, vw::ArrayProxy<vw::Vec3> positions) {
+  vw::Meshlet& meshlet = data.meshlets.back();
+  computeBoundingSphere(data, positions, meshlet);
+  computeNormalCone(data, positions, meshlet);
+}
+}  // namespace
+
+void vw::buildMeshlets(ArrayProxy<uint32_t> indices, ArrayProxy<Vec3> positions, MeshletData& meshletData) {
+  if (indices.size() < 3)
+    return;
+  std::vector<uint8_t> localIndices(positions.size(), kNotInMeshlet);
+  auto startMeshlet = [&]() {
+    Meshlet& meshlet = meshletData.meshlets.emplace_back();
+    meshlet.vertexOffset = size32(meshletData.vertices);
+    meshlet.triangleOffset = size32(meshletData.triangles);
+  };
+  startMeshlet();
+
+  for (uint32_t t = 0; t + 2 < indices.size(); t += 3) {
+    Meshlet* meshlet = &meshletData.meshlets.back();
+    uint32_t newVertices = 0;
+    for (uint32_t i = 0; i < 3; ++i)
+      newVertices += (localIndices[indices[t + i]] == kNotInMeshlet) ? 1 : 0;
+    if (meshlet->vertexCount + newVertices > kMaxMeshletVertices || meshlet->triangleCount == kMaxMeshletTriangles) {
+      for (uint32_t i = 0; i < meshlet->vertexCount; ++i)
+        localIndices[meshletData.vertices[meshlet->vertexOffset + i]] = kNotInMeshlet;
+      finishMeshlet(meshletData, positions);
+      startMeshlet();
+      meshlet = &meshletData.meshlets.back();
+    }
+    for (uint32_t i = 0; i < 3; ++i) {
+      uint8_t& local = localIndices[indices[t + i]];
+      if (local == kNotInMeshlet) {
+        local = static_cast<uint8_t>(meshlet->vertexCount++);
+        meshletData.vertices.push_back(indices[t + i]);
+      }
+      meshletData.triangles.push_back(local);
+    }
+    ++meshlet->triangleCount;
+  }
+  finishMeshlet(meshletData, positions);
+}
@@ -0,0 +1,331 @@
+#include "vkmeshopt.hpp"
+#include <algorithm>
+#include <cmath>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <limits>
+#include <numeric>
+
+namespace {
+constexpr uint32_t kForsythCacheSize = 32;
+constexpr float kCacheDecayPower = 1.5f;
+constexpr float kLastTriangleScore = 0.75f;
+constexpr float kValenceBoostScale = 2.0f;
+constexpr float kValenceBoostPower = 0.5f;
+constexpr int32_t kOverdrawGridSize = 256;
+
+float forsythVertexScore(int32_t cachePosition, uint32_t remainingTriangles) {
+  if (remainingTriangles == 0)
+    return -1.0f;
+  float score = 0.0f;
+  if (cachePosition >= 0) {
+    // The vertices of the last triangle get a fixed score so the next triangle doesn't reuse an edge and produce a strip
+    if (cachePosition < 3)
+      score = kLastTriangleScore;
+    else
+      score = std::pow(1.0f - static_cast<float>(cachePosition - 3) / (kForsythCacheSize - 3), kCacheDecayPower);
+  }
+  // Boosting vertices with few remaining triangles finishes them off instead of leaving lone triangles behind
+  return score + kValenceBoostScale * std::pow(static_cast<float>(remainingTriangles), -kValenceBoostPower);
+}
+
+// Remaining triangles of every vertex, triangles[offsets[v], offsets[v] + counts[v])
+struct TriangleAdjacency {
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> counts;
+  std::vector<uint32_t> triangles;
+
+  TriangleAdjacency(const std::vector<uint32_t>& indices, uint32_t vertexCount) : offsets(vertexCount), counts(vertexCount, 0), triangles(indices.size()) {
+    for (uint32_t index : indices)
+      ++counts[index];
+    uint32_t offset = 0;
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+      offsets[v] = offset;
+      offset += counts[v];
+      counts[v] = 0;
+    }
+    for (uint32_t i = 0; i < indices.size(); ++i) {
+      uint32_t v = indices[i];
+      triangles[offsets[v] + counts[v]++] = i / 3;
+    }
+  }
+  void remove(uint32_t vertex, uint32_t triangle) {
+    uint32_t* begin = triangles.data() + offsets[vertex];
+    uint32_t* end = begin + counts[vertex];
+    uint32_t* it = std::find(begin, end, triangle);
+    if (it != end) {
+      *it = *(end - 1);
+      --counts[vertex];
+    }
+  }
+};
+
+// Exact FIFO simulation, a vertex is still cached if fewer than cacheSize misses happened since it was loaded
+class FifoCacheSim {
+ public:
+  FifoCacheSim(uint32_t vertexCount, uint32_t cacheSize) : mLoadTime(vertexCount, 0), mCacheSize{cacheSize}, mTime{cacheSize + 1} {}
+  bool access(uint32_t vertex) {
+    if (mTime - mLoadTime[vertex] <= mCacheSize)
+      return true;
+    mLoadTime[vertex] = mTime++;
+    return false;
+  }
+  void flush() {
+    mTime += mCacheSize + 1;
+  }
+
+ private:
+  std::vector<uint64_t> mLoadTime;
+  uint64_t mCacheSize;
+  uint64_t mTime;
+};
+}  // namespace
+
+void vw::optimizeVertexCache(std::vector<uint32_t>& indices, uint32_t vertexCount) {
+  const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+  if (triangleCount == 0)
+    return;
+
+  TriangleAdjacency adjacency{indices, vertexCount};
+  std::vector<int32_t> cachePositions(vertexCount, -1);
+  std::vector<float> vertexScores(vertexCount);
+  for (uint32_t v = 0; v < vertexCount; ++v)
+    vertexScores[v] = forsythVertexScore(-1, adjacency.counts[v]);
+  auto triangleScore = [&](uint32_t t) { return vertexScores[indices[3 * t]] + vertexScores[indices[3 * t + 1]] + vertexScores[indices[3 * t + 2]]; };
+
+  int64_t bestTriangle = 0;
+  for (uint32_t t = 1; t < triangleCount; ++t)
+    if (triangleScore(t) > triangleScore(static_cast<uint32_t>(bestTriangle)))
+      bestTriangle = t;
+
+  std::vector<bool> emitted(triangleCount, false);
+  std::vector<uint32_t> cache, nextCache;
+  cache.reserve(kForsythCacheSize + 3);
+  nextCache.reserve(kForsythCacheSize + 3);
+  std::vector<uint32_t> result;
+  result.reserve(indices.size());
+  uint32_t scanCursor = 0;
+
+  while (result.size() < indices.size()) {
+    if (bestTriangle < 0) {
+      // Nothing left next to the cached vertices, restart from the next triangle in input order
+      while (emitted[scanCursor])
+        ++scanCursor;
+      bestTriangle = scanCursor;
+    }
+    const uint32_t triangle = static_cast<uint32_t>(bestTriangle);
+    emitted[triangle] = true;
+
+    nextCache.clear();
+    for (uint32_t i = 0; i < 3; ++i) {
+      uint32_t v = indices[3 * triangle + i];
+      result.push_back(v);
+      adjacency.remove(v, triangle);
+      if (std::find(nextCache.begin(), nextCache.end(), v) == nextCache.end())
+        nextCache.push_back(v);
+    }
+    for (uint32_t v : cache)
+      if (std::find(nextCache.begin(), nextCache.end(), v) == nextCache.end())
+        nextCache.push_back(v);
+    for (size_t i = kForsythCacheSize; i < nextCache.size(); ++i) {
+      cachePositions[nextCache[i]] = -1;
+      vertexScores[nextCache[i]] = forsythVertexScore(-1, adjacency.counts[nextCache[i]]);
+    }
+    if (nextCache.size() > kForsythCacheSize)
+      nextCache.resize(kForsythCacheSize);
+    for (size_t i = 0; i < nextCache.size(); ++i) {
+      cachePositions[nextCache[i]] = static_cast<int32_t>(i);
+      vertexScores[nextCache[i]] = forsythVertexScore(static_cast<int32_t>(i), adjacency.counts[nextCache[i]]);
+    }
+    std::swap(cache, nextCache);
+
+    // Only triangles touching the cache changed score, so the best one among them is the next candidate
+    bestTriangle = -1;
+    float bestScore = -1.0f;
+    for (uint32_t v : cache) {
+      for (uint32_t i = 0; i < adjacency.counts[v]; ++i) {
+        uint32_t t = adjacency.triangles[adjacency.offsets[v] + i];
+        float score = triangleScore(t);
+        if (score > bestScore) {
+          bestScore = score;
+          bestTriangle = t;
+        }
+      }
+    }
+  }
+  indices = std::move(result);
+}
+
+void vw::optimizeOverdraw(std::vector<uint32_t>& indices, ArrayProxy<Vec3> positions, float threshold) {
+  const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+  if (triangleCount < 2)
+    return;
+
+  // A cluster ends where the simulated cache misses a whole triangle, or once its own ACMR (counted from a cold cache) is within the threshold of the
+  // mesh's, so drawing the clusters in any order costs at most that much vertex cache efficiency
+  const float maxClusterAcmr = analyzeVertexCache(indices, positions.size()).acmr * threshold;
+  std::vector<uint32_t> clusterStarts;
+  FifoCacheSim cache{positions.size(), kVertexCacheAnalysisSize};
+  uint32_t clusterMisses = 0;
+  uint32_t clusterTriangles = 0;
+  for (uint32_t t = 0; t < triangleCount; ++t) {
+    uint32_t misses = 0;
+    for (uint32_t i = 0; i < 3; ++i)
+      misses += cache.access(indices[3 * t + i]) ? 0 : 1;
+    bool softBoundary = clusterTriangles > 0 && clusterMisses <= maxClusterAcmr * clusterTriangles;
+    if (t == 0 || misses == 3 || softBoundary) {
+      if (softBoundary && misses != 3) {
+        cache.flush();
+        misses = 0;
+        for (uint32_t i = 0; i < 3; ++i)
+          misses += cache.access(indices[3 * t + i]) ? 0 : 1;
+      }
+      clusterStarts.push_back(t);
+      clusterMisses = 0;
+      clusterTriangles = 0;
+    }
+    clusterMisses += misses;
+    ++clusterTriangles;
+  }
+  if (clusterStarts.size() < 2)
+    return;
+  clusterStarts.push_back(triangleCount);
+
+  Vec3 meshCentroid{0.0f};
+  for (const Vec3& pos : positions)
+    meshCentroid += pos;
+  meshCentroid /= static_cast<float>(positions.size());
+
+  // Clusters facing away from the mesh center are likely occluders of the ones facing inward, so they are drawn first
+  const size_t clusterCount = clusterStarts.size() - 1;
+  std::vector<float> sortKeys(clusterCount, 0.0f);
+  for (size_t c = 0; c < clusterCount; ++c) {
+    Vec3 centroid{0.0f}, normal{0.0f};
+    float area = 0.0f;
+    for (uint32_t t = clusterStarts[c]; t < clusterStarts[c + 1]; ++t) {
+      const Vec3& p0 = positions[indices[3 * t]];
+      const Vec3& p1 = positions[indices[3 * t + 1]];
+      const Vec3& p2 = positions[indices[3 * t + 2]];
+      Vec3 faceNormal = glm::cross(p1 - p0, p2 - p0);
+      float faceArea = glm::length(faceNormal);
+      centroid += (p0 + p1 + p2) * (faceArea / 3.0f);
+      normal += faceNormal;
+      area += faceArea;
+    }
+    float normalLength = glm::length(normal);
+    if (area > 0.0f && normalLength > 0.0f)
+      sortKeys[c] = glm::dot(centroid / area - meshCentroid, normal / normalLength);
+  }
+
+  std::vector<uint32_t> clusterOrder(clusterCount);
+  std::iota(clusterOrder.begin(), clusterOrder.end(), 0);
+  std::stable_sort(clusterOrder.begin(), clusterOrder.end(), [&](uint32_t a, uint32_t b) { return sortKeys[a] > sortKeys[b]; });
+
+  std::vector<uint32_t> result;
+  result.reserve(indices.size());
+  for (uint32_t c : clusterOrder)
+    result.insert(result.end(), indices.begin() + 3 * clusterStarts[c], indices.begin() + 3 * clusterStarts[c + 1]);
+  indices = std::move(result);
+}
+
+std::vector<uint32_t> vw::optimizeVertexFetch(std::vector<uint32_t>& indices, uint32_t vertexCount) {
+  constexpr uint32_t kUnused = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> remap(vertexCount, kUnused);
+  uint32_t nextVertex = 0;
+  for (uint32_t& index : indices) {
+    if (remap[index] == kUnused)
+      remap[index] = nextVertex++;
+    index = remap[index];
+  }
+  for (uint32_t& newIndex : remap)
+    if (newIndex == kUnused)
+      newIndex = nextVertex++;
+  return remap;
+}
+
+vw::VertexCacheStats vw::analyzeVertexCache(ArrayProxy<uint32_t> indices, uint32_t vertexCount, uint32_t cacheSize) {
+  const uint32_t triangleCount = indices.size() / 3;
+  if (triangleCount == 0)
+    return {};
+  FifoCacheSim cache{vertexCount, cacheSize};
+  std::vector<bool> referenced(vertexCount, false);
+  uint32_t misses = 0;
+  uint32_t uniqueVertices = 0;
+  for (uint32_t index : indices) {
+    misses += cache.access(index) ? 0 : 1;
+    if (!referenced[index]) {
+      referenced[index] = true;
+      ++uniqueVertices;
+    }
+  }
+  return {static_cast<float>(misses) / triangleCount, static_cast<float>(misses) / uniqueVertices};
+}
+
+vw::OverdrawStats vw::analyzeOverdraw(ArrayProxy<uint32_t> indices, ArrayProxy<Vec3> positions) {
+  if (indices.size() < 3 || positions.size() == 0)
+    return {};
+
+  Vec3 min = positions[0], max = positions[0];
+  for (const Vec3& pos : positions) {
+    min = glm::min(pos, min);
+    max = glm::max(pos, max);
+  }
+  float extent = glm::max(max.x - min.x, glm::max(max.y - min.y, max.z - min.z));
+  if (extent <= 0.0f)
+    return {};
+  const float toGrid = (kOverdrawGridSize - 1) / extent;
+
+  std::vector<float> depthBuffer(kOverdrawGridSize * kOverdrawGridSize);
+  std::vector<Vec3> projected(positions.size());
+  uint64_t shadedFragments = 0;
+  uint64_t coveredPixels = 0;
+
+  // Views along +-X, +-Y and +-Z, each a right-handed basis so the same winding is front-facing in all of them. Larger depth is closer, fragments
+  // are counted when they pass an early depth test in submission order
+  for (int axis = 0; axis < 3; ++axis) {
+    for (float sign : {1.0f, -1.0f}) {
+      const int uAxis = (axis + 1) % 3;
+      const int vAxis = (axis + 2) % 3;
+      for (uint32_t i = 0; i < positions.size(); ++i) {
+        Vec3 local = positions[i] - min;
+        float u = (sign > 0.0f) ? local[uAxis] : extent - local[uAxis];
+        projected[i] = {u * toGrid, local[vAxis] * toGrid, sign * local[axis]};
+      }
+      std::fill(depthBuffer.begin(), depthBuffer.end(), -std::numeric_limits<float>::infinity());
+
+      for (uint32_t t = 0; t + 2 < indices.size(); t += 3) {
+        const Vec3& p0 = projected[indices[t]];
+        const Vec3& p1 = projected[indices[t + 1]];
+        const Vec3& p2 = projected[indices[t + 2]];
+        float area = (p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y);
+        if (area <= 0.0f)
+          continue;
+        int32_t minX = std::max(0, static_cast<int32_t>(std::floor(glm::min(p0.x, glm::min(p1.x, p2.x)))));
+        int32_t minY = std::max(0, static_cast<int32_t>(std::floor(glm::min(p0.y, glm::min(p1.y, p2.y)))));
+        int32_t maxX = std::min(kOverdrawGridSize - 1, static_cast<int32_t>(std::ceil(glm::max(p0.x, glm::max(p1.x, p2.x)))));
+        int32_t maxY = std::min(kOverdrawGridSize - 1, static_cast<int32_t>(std::ceil(glm::max(p0.y, glm::max(p1.y, p2.y)))));
+        for (int32_t y = minY; y <= maxY; ++y) {
+          for (int32_t x = minX; x <= maxX; ++x) {
+            float px = x + 0.5f, py = y + 0.5f;
+            float w0 = (p2.x - p1.x) * (py - p1.y) - (p2.y - p1.y) * (px - p1.x);
+            float w1 = (p0.x - p2.x) * (py - p2.y) - (p0.y - p2.y) * (px - p2.x);
+            float w2 = (p1.x - p0.x) * (py - p0.y) - (p1.y - p0.y) * (px - p0.x);
+            if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+              continue;
+            float depth = (w0 * p0.z + w1 * p1.z + w2 * p2.z) / area;
+            float& stored = depthBuffer[y * kOverdrawGridSize + x];
+            if (depth > stored) {
+              stored = depth;
+              ++shadedFragments;
+            }
+          }
+        }
+      }
+      for (float depth : depthBuffer)
+        coveredPixels += std::isinf(depth) ? 0 : 1;
+    }
+  }
+  if (coveredPixels == 0)
+    return {};
+  return {static_cast<float>(shadedFragments) / coveredPixels};
+}
@@ -0,0 +1,174 @@
+#include "vkmipgen.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VW_MIPGEN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+// 8-bit sRGB to 16-bit linear and 12-bit linear back to 8-bit sRGB, 12 bits still give every dark sRGB value its own step
+struct SrgbTables {
+  std::array<uint16_t, 256> toLinear;
+  std::array<uint8_t, 4096> fromLinear;
+  SrgbTables() {
+    for (uint32_t i = 0; i < toLinear.size(); ++i) {
+      float c = i / 255.0f;
+      float l = (c <= 0.04045f) ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+      toLinear[i] = static_cast<uint16_t>(l * 65535.0f + 0.5f);
+    }
+    for (uint32_t i = 0; i < fromLinear.size(); ++i) {
+      float l = i / 4095.0f;
+      float c = (l <= 0.0031308f) ? l * 12.92f : 1.055f * std::pow(l, 1.0f / 2.4f) - 0.055f;
+      fromLinear[i] = static_cast<uint8_t>(c * 255.0f + 0.5f);
+    }
+  }
+};
+
+#ifdef VW_MIPGEN_SSE2
+// Adds every texel of 8 vertically summed 16-bit channels to its right neighbour and moves the four resulting channel sums into lanes 0..3
+inline __m128i sumTexelPairs(__m128i v, uint32_t channelCount) {
+  switch (channelCount) {
+    case 1:
+      v = _mm_add_epi16(v, _mm_srli_si128(v, 2));
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 1, 2, 0));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(3, 1, 2, 0));
+      return _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0));
+    case 2:
+      v = _mm_add_epi16(v, _mm_srli_si128(v, 4));
+      return _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0));
+    default:
+      return _mm_add_epi16(v, _mm_srli_si128(v, 8));
+  }
+}
+
+// Writes 16 bytes of destination texels per iteration, returns how many texels were written
+uint32_t downsampleRowSse2(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, uint32_t texelCount, uint32_t channelCount) {
+  const uint32_t step = 16 / channelCount;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi16(2);
+  uint32_t x = 0;
+  for (; x + step <= texelCount; x += step) {
+    const uint8_t* src0 = row0 + 2 * x * channelCount;
+    const uint8_t* src1 = row1 + 2 * x * channelCount;
+    __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0));
+    __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + 16));
+    __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1));
+    __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + 16));
+    __m128i s0 = sumTexelPairs(_mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero)), channelCount);
+    __m128i s1 = sumTexelPairs(_mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero)), channelCount);
+    __m128i s2 = sumTexelPairs(_mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero)), channelCount);
+    __m128i s3 = sumTexelPairs(_mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero)), channelCount);
+    __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), round), 2);
+    __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), round), 2);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * channelCount), _mm_packus_epi16(lo, hi));
+  }
+  return x;
+}
+#endif
+
+// Filters one destination row from two source rows, odd source widths clamp the second texel of the last column to the edge
+void downsampleRow(const uint8_t* row0,
+                   const uint8_t* row1,
+                   uint32_t srcWidth,
+                   uint8_t* dstRow,
+                   uint32_t dstWidth,
+                   uint32_t channelCount,
+                   const SrgbTables* srgb) {
+  const uint32_t alphaChannel = (channelCount == 2 || channelCount == 4) ? channelCount - 1 : channelCount;
+  uint32_t x = 0;
+#ifdef VW_MIPGEN_SSE2
+  if (srgb == nullptr)
+    x = downsampleRowSse2(row0, row1, dstRow, std::min(dstWidth, srcWidth / 2), channelCount);
+#endif
+  for (; x < dstWidth; ++x) {
+    const size_t x0 = std::min(2 * x, srcWidth - 1) * channelCount;
+    const size_t x1 = std::min(2 * x + 1, srcWidth - 1) * channelCount;
+    for (uint32_t c = 0; c < channelCount; ++c) {
+      uint8_t* out = &dstRow[x * channelCount + c];
+      if (srgb != nullptr && c != alphaChannel) {
+        uint32_t sum = srgb->toLinear[row0[x0 + c]] + srgb->toLinear[row0[x1 + c]] + srgb->toLinear[row1[x0 + c]] + srgb->toLinear[row1[x1 + c]];
+        // Four white texels round up to 4096, one past the table
+        *out = srgb->fromLinear[std::min((sum + 32) >> 6, 4095u)];
+      } else {
+        *out = static_cast<uint8_t>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+      }
+    }
+  }
+}
+
+// Every level keeps its last two rows, a row of the next level is filtered as soon as both of its source rows exist. Levels round their
+// extent down, so the last row of an odd height level is only filtered when it is the only one
+class MipChainWriter {
+ public:
+  MipChainWriter(uint32_t width, uint32_t height, uint32_t channelCount, const SrgbTables* srgb, uint8_t* dst)
+      : mChannelCount{channelCount}, mSrgb{srgb} {
+    for (uint32_t w = width, h = height; w > 1 || h > 1;) {
+      w = std::max(w >> 1, 1u);
+      h = std::max(h >> 1, 1u);
+      const size_t pitch = static_cast<size_t>(w) * channelCount;
+      mLevels.push_back({w, h, dst, std::vector<uint8_t>(2 * pitch), 0});
+      dst += pitch * h;
+    }
+  }
+  // Filters row y of level index + 1 from two rows of the level above it, index 0 being the base level
+  void writeRow(size_t index, const uint8_t* row0, const uint8_t* row1, uint32_t srcWidth) {
+    Level& level = mLevels[index];
+    const size_t pitch = static_cast<size_t>(level.width) * mChannelCount;
+    const uint32_t y = level.rowCount++;
+    uint8_t* row = level.rows.data() + (y & 1) * pitch;
+    downsampleRow(row0, row1, srcWidth, row, level.width, mChannelCount, mSrgb);
+    std::copy(row, row + pitch, level.dst + y * pitch);
+    if (index + 1 == mLevels.size())
+      return;
+    if (y & 1)
+      writeRow(index + 1, level.rows.data(), row, level.width);
+    else if (level.height == 1)
+      writeRow(index + 1, row, row, level.width);
+  }
+
+ private:
+  struct Level {
+    uint32_t width;
+    uint32_t height;
+    uint8_t* dst;
+    std::vector<uint8_t> rows;
+    uint32_t rowCount;
+  };
+  uint32_t mChannelCount;
+  const SrgbTables* mSrgb;
+  std::vector<Level> mLevels;
+};
+}  // namespace
+
+size_t vw::getMipChainSize(uint32_t width, uint32_t height, uint32_t channelCount) {
+  size_t chainSize = 0;
+  for (uint32_t w = width, h = height; w > 1 || h > 1;) {
+    w = std::max(w >> 1, 1u);
+    h = std::max(h >> 1, 1u);
+    chainSize += static_cast<size_t>(w) * h * channelCount;
+  }
+  return chainSize;
+}
+
+void vw::generateMipChain(const std::byte* base, uint32_t width, uint32_t height, uint32_t channelCount, bool srgb, std::byte* dst) {
+  if (channelCount != 1 && channelCount != 2 && channelCount != 4)
+    throw std::runtime_error("Mip generation supports 1, 2 or 4 channels, got " + std::to_string(channelCount));
+  if (width <= 1 && height <= 1)
+    return;
+
+  static const SrgbTables kSrgbTables;
+  MipChainWriter writer{width, height, channelCount, srgb ? &kSrgbTables : nullptr, reinterpret_cast<uint8_t*>(dst)};
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(base);
+  const size_t srcPitch = static_cast<size_t>(width) * channelCount;
+  for (uint32_t y = 0; y < std::max(height >> 1, 1u); ++y) {
+    const uint8_t* row0 = src + std::min(2 * y, height - 1) * srcPitch;
+    const uint8_t* row1 = src + std::min(2 * y + 1, height - 1) * srcPitch;
+    writer.writeRow(0, row0, row1, width);
+  }
+}
@@ -1,21 +1,102 @@
 #include "vkmodel.hpp"
+#include <algorithm>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 #include <assimp/Importer.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/matrix_operation.hpp>
 #include <glm/mat4x4.hpp>
+#include <iostream>
+#include <iterator>
 #include <queue>
 #include <stack>
-#include "vkdds.hpp"
+#include "vkdefrag.hpp"
+#include "vkmeshopt.hpp"
+#include "vkscenecache.hpp"
+#include "vksimplify.hpp"
+#include "vkthreadpool.hpp"
 #include "vkutils.hpp"
 
 static_assert(sizeof(vw::Vec3) == sizeof(aiVector3t<ai_real>));
 
+static constexpr std::array<vw::DefaultTexture, vw::TextureType::MaxEnum> kDefaultTextures{vw::DefaultTexture::Black, vw::DefaultTexture::FlatNormal,
+                                                                                          vw::DefaultTexture::Specular};
+
 static const std::unordered_map<aiTextureType, vw::TextureType> kTextureTypeMap{{aiTextureType_DIFFUSE, vw::TextureType::Diffuse},
                                                                                 {aiTextureType_SPECULAR, vw::TextureType::Specular},
                                                                                 {aiTextureType_NORMALS, vw::TextureType::Normals}};
 
+namespace {
+uint32_t getImportFlags(const vw::SceneOptions& options) {
+  uint32_t importFlags = aiProcessPreset_TargetRealtime_Quality;
+  importFlags |= aiProcess_CalcTangentSpace;
+  importFlags |= aiProcess_RemoveComponent;
+  // Replaced by the vertex cache pass in optimizeMeshes, without it Assimp's own pass still runs
+  if (options.optimizeMeshes)
+    importFlags &= ~aiProcess_ImproveCacheLocality;
+  importFlags &= ~aiProcess_FindDegenerates;
+  importFlags &= ~aiProcess_OptimizeGraph;
+  importFlags &= ~aiProcess_RemoveRedundantMaterials;
+  importFlags &= ~aiProcess_SplitLargeMeshes;
+  return importFlags;
+}
+constexpr uint32_t kRemovedComponents = aiComponent_COLORS;
+
+// Everything that changes the baked scene data has to be part of the cache key
+uint32_t getImportOptions(const vw::SceneOptions& options) {
+  return kRemovedComponents | (static_cast<uint32_t>(options.vertexFormat) << 24) | (static_cast<uint32_t>(options.vertexLayout) << 26) |
+         (static_cast<uint32_t>(options.optimizeMeshes) << 28) | (static_cast<uint32_t>(options.generateMeshlets) << 29) |
+         (std::min(options.lodCount, vw::kMaxLodCount) << 16);
+}
+
+vw::TextureDecodeOptions getTextureDecodeOptions(vw::TextureType type, const vw::SceneOptions& options) {
+  vw::TextureDecodeOptions decodeOptions;
+  decodeOptions.cacheDirectory = options.textureCacheDirectory;
+  // Blitted mips of the sRGB diffuse maps would be averaged in gamma space, those are filtered on the CPU instead
+  if (type == vw::TextureType::Diffuse) {
+    decodeOptions.mipGeneration = vw::MipGeneration::Cpu;
+    decodeOptions.srgb = true;
+  }
+  if (options.compressTextures)
+    decodeOptions.compression = (type == vw::TextureType::Normals) ? vw::TextureCompression::Normal : vw::TextureCompression::Color;
+  // Two channel normal maps would otherwise be swizzled like grey-alpha images, the shader reads XY from R and G
+  if (!options.compressTextures && type == vw::TextureType::Normals)
+    decodeOptions.componentCount = 4;
+  return decodeOptions;
+}
+
+// Flattened CPU-side copy of an imported scene, in the exact layout it is uploaded in
+struct ImportedScene {
+  // fp32 source attributes, encoded into vertexStreams before upload
+  std::vector<vw::Vec3> positions, normals, tangents, uvs;
+  std::vector<std::vector<std::byte>> vertexStreams;
+  // Mesh-relative indices of every mesh, only the 32-bit index region once encodeIndexStreams moved the meshes that fit into indices16
+  std::vector<uint32_t> indices;
+  std::vector<uint16_t> indices16;
+  std::vector<vw::MeshInfo> meshes;
+  std::vector<vw::MeshLod> lods;
+  std::vector<vw::PerMeshData> perMeshData;
+  std::vector<glm::mat4> meshMatrices;
+  std::vector<vw::MaterialFiles> materials;
+  vw::MeshletData meshletData;
+};
+
+// Non-owning view of the scene data, backed either by an ImportedScene or by a mapped scene cache
+struct SceneView {
+  std::vector<vw::ArrayProxy<std::byte>> vertexStreams;
+  vw::ArrayProxy<uint16_t> indices16;
+  vw::ArrayProxy<uint32_t> indices32;
+  vw::ArrayProxy<vw::MeshInfo> meshes;
+  vw::ArrayProxy<vw::MeshLod> lods;
+  vw::ArrayProxy<vw::PerMeshData> perMeshData;
+  vw::ArrayProxy<glm::mat4> meshMatrices;
+  std::vector<vw::MaterialFiles> materials;
+  vw::ArrayProxy<vw::Meshlet> meshlets;
+  vw::ArrayProxy<uint32_t> meshletVertices;
+  vw::ArrayProxy<uint8_t> meshletTriangles;
+};
+}  // namespace
+
 vw::MaterialFiles convertAiMaterial(const std::filesystem::path& parentPath, const aiMaterial* aiMat) {
   vw::MaterialFiles mat;
   aiString texPath;
@@ -31,27 +112,56 @@ vw::MaterialFiles convertAiMaterial(const std::filesystem::path& parentPath, con
   return mat;
 }
 
-vw::Scene::Scene(vw::MemoryAllocator& allocator, vw::StagingBuffer& stagingBuf, const std::filesystem::path& modelPath) {
-  uint32_t importFlags = aiProcessPreset_TargetRealtime_Quality;
-  importFlags |= aiProcess_CalcTangentSpace;
-  importFlags |= aiProcess_RemoveComponent;
-  importFlags &= ~aiProcess_FindDegenerates;
-  importFlags &= ~aiProcess_OptimizeGraph;
-  importFlags &= ~aiProcess_RemoveRedundantMaterials;
-  importFlags &= ~aiProcess_SplitLargeMeshes;
+// Material texture paths are stored as a (length, utf-8 bytes) pair per texture slot, length 0 marks an empty slot
+std::vector<char> packMaterialFiles(const std::vector<vw::MaterialFiles>& materials) {
+  std::vector<char> packed;
+  for (const auto& mat : materials) {
+    for (auto i = 0; i < vw::TextureType::MaxEnum; ++i) {
+      auto it = mat.textures.find(static_cast<vw::TextureType>(i));
+      std::string path = (it != mat.textures.end()) ? it->second.u8string() : std::string{};
+      uint32_t length = static_cast<uint32_t>(path.size());
+      packed.insert(packed.end(), reinterpret_cast<const char*>(&length), reinterpret_cast<const char*>(&length + 1));
+      packed.insert(packed.end(), path.begin(), path.end());
+    }
+  }
+  return packed;
+}
 
+std::vector<vw::MaterialFiles> unpackMaterialFiles(vw::ArrayProxy<char> packed) {
+  std::vector<vw::MaterialFiles> materials;
+  const char* cur = packed.begin();
+  while (cur != packed.end()) {
+    vw::MaterialFiles& mat = materials.emplace_back();
+    for (auto i = 0; i < vw::TextureType::MaxEnum; ++i) {
+      uint32_t length;
+      if (static_cast<size_t>(packed.end() - cur) < sizeof(length))
+        throw std::runtime_error("Corrupt material section in scene cache");
+      std::memcpy(&length, cur, sizeof(length));
+      cur += sizeof(length);
+      if (static_cast<size_t>(packed.end() - cur) < length)
+        throw std::runtime_error("Corrupt material section in scene cache");
+      if (length > 0)
+        mat.textures.emplace(static_cast<vw::TextureType>(i), std::filesystem::u8path(cur, cur + length));
+      cur += length;
+    }
+  }
+  return materials;
+}
+
+ImportedScene importScene(const std::filesystem::path& modelPath, uint32_t importFlags) {
   Assimp::Importer importer;
-  importer.SetPropertyInteger(AI_CONFIG_PP_RVC_FLAGS, aiComponent_COLORS);
+  importer.SetPropertyInteger(AI_CONFIG_PP_RVC_FLAGS, kRemovedComponents);
   const aiScene* scene = importer.ReadFile(modelPath.string(), importFlags);
 
   if (!(scene && scene->mRootNode))
     throw std::runtime_error("Model has no root node!");
 
-  mMaterials.emplace(scene->mNumMaterials);
-  for (aiMaterial* aiMat : vw::ArrayProxy{scene->mMaterials, scene->mNumMaterials}) {
-    mMaterials->emplace_back(allocator, convertAiMaterial(modelPath.parent_path(), aiMat));
-  }
+  ImportedScene imported;
+  imported.materials.reserve(scene->mNumMaterials);
+  for (aiMaterial* aiMat : vw::ArrayProxy{scene->mMaterials, scene->mNumMaterials})
+    imported.materials.push_back(convertAiMaterial(modelPath.parent_path(), aiMat));
 
+  uint32_t totalInstanceCount = 0;
   std::vector<std::vector<glm::mat4>> instanceTransforms(scene->mNumMeshes);
   std::stack<std::tuple<aiNode*, glm::mat4>> nodeTreeDfs;
   nodeTreeDfs.push(std::make_tuple(scene->mRootNode, glm::diagonal4x4(glm::vec4{1.0, 1.0, 1.0, 1.0})));
@@ -65,26 +175,16 @@ vw::Scene::Scene(vw::MemoryAllocator& allocator, vw::StagingBuffer& stagingBuf,
     curMatrix = glm::transpose(curMatrix);
     curMatrix = parentMatrix * curMatrix;
 
-    mTotalInstanceCount += curNode->mNumMeshes;
+    totalInstanceCount += curNode->mNumMeshes;
     for (auto meshIdx : vw::ArrayProxy{curNode->mMeshes, curNode->mNumMeshes})
       instanceTransforms[meshIdx].push_back(curMatrix);
     for (auto childNode : vw::ArrayProxy{curNode->mChildren, curNode->mNumChildren})
       nodeTreeDfs.push(std::make_tuple(childNode, curMatrix));
   }
 
-  std::vector<vw::ArrayProxy<vw::Vec3>> positions, normals, tangents, uvs;
-  std::vector<PerMeshData> perMeshData;
-  std::vector<uint32_t> indices;
-  std::vector<glm::mat4> meshMatrices;
-  std::vector<vk::DrawIndexedIndirectCommand> drawCommands;
-  positions.reserve(scene->mNumMeshes);
-  normals.reserve(scene->mNumMeshes);
-  tangents.reserve(scene->mNumMeshes);
-  uvs.reserve(scene->mNumMeshes);
-  mMeshes.reserve(scene->mNumMeshes);
-  perMeshData.reserve(scene->mNumMeshes);
-  meshMatrices.reserve(mTotalInstanceCount);
-  drawCommands.reserve(scene->mNumMeshes);
+  imported.meshes.reserve(scene->mNumMeshes);
+  imported.perMeshData.reserve(scene->mNumMeshes);
+  imported.meshMatrices.reserve(totalInstanceCount);
 
   for (size_t meshIdx = 0; meshIdx < scene->mNumMeshes; ++meshIdx) {
     const aiMesh* mesh = scene->mMeshes[meshIdx];
@@ -92,75 +192,428 @@ vw::Scene::Scene(vw::MemoryAllocator& allocator, vw::StagingBuffer& stagingBuf,
       continue;
     }
     uint32_t indexCount = 3 * mesh->mNumFaces;
-    mMeshes.push_back({indexCount, mTotalIndexCount, mTotalVertexCount, mesh->mMaterialIndex});
-    drawCommands.push_back({indexCount, vw::size32(instanceTransforms[meshIdx]), mTotalIndexCount, static_cast<int32_t>(mTotalVertexCount), 0});
-    mTotalVertexCount += mesh->mNumVertices;
-    mTotalIndexCount += indexCount;
-    positions.emplace_back(reinterpret_cast<vw::Vec3*>(mesh->mVertices), mesh->mNumVertices);
-    normals.emplace_back(reinterpret_cast<vw::Vec3*>(mesh->mNormals), mesh->mNumVertices);
-    tangents.emplace_back(reinterpret_cast<vw::Vec3*>(mesh->mTangents), mesh->mNumVertices);
-    uvs.emplace_back(reinterpret_cast<vw::Vec3*>(mesh->mTextureCoords[0]), mesh->mNumVertices);
-    indices.reserve(indexCount);
+    uint32_t firstIndex = vw::size32(imported.indices);
+    uint32_t vertexOffset = vw::size32(imported.positions);
+    imported.meshes.push_back({indexCount, firstIndex, vertexOffset, mesh->mMaterialIndex, mesh->mNumVertices, vw::size32(instanceTransforms[meshIdx])});
+
+    auto appendStream = [&](std::vector<vw::Vec3>& stream, const aiVector3D* src) {
+      stream.insert(stream.end(), reinterpret_cast<const vw::Vec3*>(src), reinterpret_cast<const vw::Vec3*>(src) + mesh->mNumVertices);
+    };
+    appendStream(imported.positions, mesh->mVertices);
+    appendStream(imported.normals, mesh->mNormals);
+    appendStream(imported.tangents, mesh->mTangents);
+    appendStream(imported.uvs, mesh->mTextureCoords[0]);
+    vw::MeshInfo& meshInfo = imported.meshes.back();
+    vw::Vec3 min = imported.positions[vertexOffset], max = min;
+    for (uint32_t i = vertexOffset; i < imported.positions.size(); ++i) {
+      min = glm::min(imported.positions[i], min);
+      max = glm::max(imported.positions[i], max);
+    }
+    meshInfo.boundsCenter = (min + max) * 0.5f;
+    for (uint32_t i = vertexOffset; i < imported.positions.size(); ++i)
+      meshInfo.boundsRadius = std::max(meshInfo.boundsRadius, glm::length(imported.positions[i] - meshInfo.boundsCenter));
+    imported.indices.reserve(imported.indices.size() + indexCount);
     for (auto& face : vw::ArrayProxy{mesh->mFaces, mesh->mNumFaces}) {
-      indices.insert(indices.end(), &(face.mIndices[0]), &(face.mIndices[3]));
+      imported.indices.insert(imported.indices.end(), &(face.mIndices[0]), &(face.mIndices[3]));
     }
 
-    perMeshData.push_back({mesh->mMaterialIndex, vw::size32(meshMatrices)});
+    vw::PerMeshData& meshData = imported.perMeshData.emplace_back();
+    meshData.materialIdx = mesh->mMaterialIndex;
+    meshData.modelMatrixBaseIndex = vw::size32(imported.meshMatrices);
     auto& curMeshMatrices = instanceTransforms[meshIdx];
-    meshMatrices.insert(meshMatrices.end(), curMeshMatrices.begin(), curMeshMatrices.end());
+    imported.meshMatrices.insert(imported.meshMatrices.end(), curMeshMatrices.begin(), curMeshMatrices.end());
   }
+  return imported;
+}
+
+// Reorders the triangles of every mesh for vertex cache reuse and overdraw, then its vertices in fetch order
+void optimizeMeshes(ImportedScene& imported, bool printStats) {
+  for (size_t meshIdx = 0; meshIdx < imported.meshes.size(); ++meshIdx) {
+    const vw::MeshInfo& mesh = imported.meshes[meshIdx];
+    auto firstIndex = imported.indices.begin() + mesh.firstIndex;
+    std::vector<uint32_t> indices(firstIndex, firstIndex + mesh.indexCount);
+    vw::ArrayProxy<vw::Vec3> positions(imported.positions.data() + mesh.vertexOffset, mesh.vertexCount);
 
-  mVbo.emplace(allocator, mTotalVertexCount * 4 * sizeof(vw::Vec3), vw::BufferUse::kVertexBuffer);
-  mIbo.emplace(allocator, mTotalIndexCount * sizeof(uint32_t), vw::BufferUse::kIndexBuffer);
+    vw::VertexCacheStats cacheBefore;
+    vw::OverdrawStats overdrawBefore;
+    if (printStats) {
+      cacheBefore = vw::analyzeVertexCache(indices, mesh.vertexCount);
+      overdrawBefore = vw::analyzeOverdraw(indices, positions);
+    }
 
-  stagingBuf.queueBufferCopies(positions, *mVbo);
-  stagingBuf.queueBufferCopies(normals, *mVbo, mTotalVertexCount * sizeof(vw::Vec3));
-  stagingBuf.queueBufferCopies(tangents, *mVbo, 2 * mTotalVertexCount * sizeof(vw::Vec3));
-  stagingBuf.queueBufferCopies(uvs, *mVbo, 3 * mTotalVertexCount * sizeof(vw::Vec3));
-  stagingBuf.queueBufferCopy(indices, *mIbo);
-  for (auto& mat : mMaterials.value())
-    mat.queueCopies(stagingBuf);
+    vw::optimizeVertexCache(indices, mesh.vertexCount);
+    vw::optimizeOverdraw(indices, positions);
+    std::vector<uint32_t> remap = vw::optimizeVertexFetch(indices, mesh.vertexCount);
+    for (auto* attribute : {&imported.positions, &imported.normals, &imported.tangents, &imported.uvs})
+      vw::remapVertices(attribute->data() + mesh.vertexOffset, remap);
+    std::copy(indices.begin(), indices.end(), firstIndex);
 
-  mUbo.emplace(allocator, std::initializer_list<vk::DeviceSize>{vw::byteSize(perMeshData), vw::byteSize(meshMatrices)}, vw::BufferUse::kStorageBuffer,
-               VMA_MEMORY_USAGE_CPU_TO_GPU);
-  mUbo->copyToMapped(perMeshData, 0);
-  mUbo->copyToMapped(meshMatrices, 1);
+    if (printStats) {
+      auto cacheAfter = vw::analyzeVertexCache(indices, mesh.vertexCount);
+      auto overdrawAfter = vw::analyzeOverdraw(indices, positions);
+      std::cout << "Mesh " << meshIdx << " (" << mesh.indexCount / 3 << " triangles): ACMR " << cacheBefore.acmr << " -> " << cacheAfter.acmr << ", ATVR "
+                << cacheBefore.atvr << " -> " << cacheAfter.atvr << ", overdraw " << overdrawBefore.overdraw << " -> " << overdrawAfter.overdraw << std::endl;
+    }
+  }
+}
 
-  mIndirectBuffer.emplace(allocator, vw::byteSize(drawCommands), vk::BufferUsageFlagBits::eIndirectBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU);
-  mIndirectBuffer->copyToMapped(drawCommands);
+// Encodes the fp32 source attributes into one stream per vertex binding and stores the per-mesh position dequantization
+void encodeVertexStreams(ImportedScene& imported, vw::VertexFormat format, const vw::VertexInputDescription& vertexInput) {
+  const std::array<const std::vector<vw::Vec3>*, vw::kVertexAttributeCount> sources{&imported.positions, &imported.normals, &imported.tangents,
+                                                                                    &imported.uvs};
+  imported.vertexStreams.assign(vertexInput.bindings.size(), {});
+  for (const auto& binding : vertexInput.bindings)
+    imported.vertexStreams[binding.binding].resize(imported.positions.size() * binding.stride);
 
-  mPerMeshShaderDataDesc = mUbo->getSegmentDesc(0);
-  mModelMatrixArrayDesc = mUbo->getSegmentDesc(1);
+  for (size_t meshIdx = 0; meshIdx < imported.meshes.size(); ++meshIdx) {
+    const vw::MeshInfo& mesh = imported.meshes[meshIdx];
+    auto quantization = vw::computePositionQuantization(format, vw::ArrayProxy<vw::Vec3>(imported.positions.data() + mesh.vertexOffset, mesh.vertexCount));
+    imported.perMeshData[meshIdx].positionOffset = quantization.offset;
+    imported.perMeshData[meshIdx].positionScale = quantization.scale;
+    for (const auto& attribute : vertexInput.attributes) {
+      uint32_t stride = vertexInput.bindings[attribute.binding].stride;
+      std::byte* dst = imported.vertexStreams[attribute.binding].data() + mesh.vertexOffset * stride + attribute.offset;
+      vw::ArrayProxy<vw::Vec3> src(sources[attribute.location]->data() + mesh.vertexOffset, mesh.vertexCount);
+      vw::encodeAttribute(format, static_cast<vw::VertexAttribute>(attribute.location), src, quantization, dst, stride);
+    }
+  }
 }
 
-vw::Material::Material(vw::MemoryAllocator& allocator, const MaterialFiles& files) {
-  for (auto i = 0; i < vw::TextureType::MaxEnum; ++i) {
-    auto texType = static_cast<vw::TextureType>(i);
-    auto& tex = mTextures[i];
+// Runs on the final mesh-relative index order, before the indices are split by index type
+void buildMeshlets(ImportedScene& imported) {
+  for (vw::MeshInfo& mesh : imported.meshes) {
+    mesh.firstMeshlet = vw::size32(imported.meshletData.meshlets);
+    vw::ArrayProxy<uint32_t> indices(imported.indices.data() + mesh.firstIndex, mesh.indexCount);
+    vw::ArrayProxy<vw::Vec3> positions(imported.positions.data() + mesh.vertexOffset, mesh.vertexCount);
+    vw::buildMeshlets(indices, positions, imported.meshletData);
+    mesh.meshletCount = vw::size32(imported.meshletData.meshlets) - mesh.firstMeshlet;
+  }
+}
 
-    if (files.textures.count(texType)) {
-      auto& path = files.textures.at(texType);
-      if (path.extension() == ".dds")
-        tex.imageFile = std::make_unique<vw::dds::DDSFile>(path);
+// Every mesh gets its full resolution LOD followed by up to lodCount - 1 simplified ones appended to the index list, each simplified from the
+// previous level. The chain ends early once a level can't shed at least a tenth of its triangles within kMaxLodError
+void generateLods(ImportedScene& imported, uint32_t lodCount, bool optimize) {
+  // Relative to the mesh's bounding radius
+  constexpr float kMaxLodError = 0.05f;
+  imported.lods.clear();
+  for (vw::MeshInfo& mesh : imported.meshes) {
+    mesh.firstLod = vw::size32(imported.lods);
+    imported.lods.push_back({mesh.indexCount, mesh.firstIndex, 0.0f});
+    vw::ArrayProxy<vw::Vec3> positions(imported.positions.data() + mesh.vertexOffset, mesh.vertexCount);
+    std::vector<uint32_t> previous(imported.indices.begin() + mesh.firstIndex, imported.indices.begin() + mesh.firstIndex + mesh.indexCount);
+    float totalError = 0.0f;
+    for (uint32_t level = 1; level < lodCount; ++level) {
+      uint32_t targetIndexCount = vw::size32(previous) / 6 * 3;
+      float levelError = 0.0f;
+      std::vector<uint32_t> simplified = vw::simplifyMesh(previous, positions, targetIndexCount, kMaxLodError * mesh.boundsRadius, levelError);
+      if (simplified.empty() || simplified.size() * 10 > previous.size() * 9)
+        break;
+      if (optimize)
+        vw::optimizeVertexCache(simplified, mesh.vertexCount);
+      totalError += levelError;
+      imported.lods.push_back({vw::size32(simplified), vw::size32(imported.indices), totalError});
+      imported.indices.insert(imported.indices.end(), simplified.begin(), simplified.end());
+      previous = std::move(simplified);
+    }
+    mesh.lodCount = vw::size32(imported.lods) - mesh.firstLod;
+  }
+}
+
+// Moves the indices of meshes with at most 2^16 vertices into the 16-bit index region, firstIndex of the mesh and its LODs becomes relative
+// to the mesh's region
+void encodeIndexStreams(ImportedScene& imported) {
+  std::vector<uint32_t> indices32;
+  for (vw::MeshInfo& mesh : imported.meshes) {
+    mesh.indexType = (mesh.vertexCount <= (1u << 16)) ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+    for (uint32_t lodIdx = mesh.firstLod; lodIdx < mesh.firstLod + mesh.lodCount; ++lodIdx) {
+      vw::MeshLod& lod = imported.lods[lodIdx];
+      auto first = imported.indices.begin() + lod.firstIndex;
+      if (mesh.indexType == vk::IndexType::eUint16) {
+        lod.firstIndex = vw::size32(imported.indices16);
+        std::transform(first, first + lod.indexCount, std::back_inserter(imported.indices16), [](uint32_t index) { return static_cast<uint16_t>(index); });
+      } else {
+        lod.firstIndex = vw::size32(indices32);
+        indices32.insert(indices32.end(), first, first + lod.indexCount);
+      }
+    }
+    mesh.firstIndex = imported.lods[mesh.firstLod].firstIndex;
+  }
+  imported.indices = std::move(indices32);
+}
+
+void writeSceneCache(const ImportedScene& imported, const std::filesystem::path& cachePath, const vw::SceneCacheKey& key) {
+  std::vector<char> packedMaterials = packMaterialFiles(imported.materials);
+  vw::SceneCacheWriter writer;
+  for (size_t i = 0; i < imported.vertexStreams.size(); ++i) {
+    auto section = static_cast<vw::SceneCacheSection>(static_cast<size_t>(vw::SceneCacheSection::VertexStream0) + i);
+    writer.addSection(section, imported.vertexStreams[i]);
+  }
+  writer.addSection(vw::SceneCacheSection::Indices16, imported.indices16);
+  writer.addSection(vw::SceneCacheSection::Indices32, imported.indices);
+  writer.addSection(vw::SceneCacheSection::Meshes, imported.meshes);
+  writer.addSection(vw::SceneCacheSection::MeshLods, imported.lods);
+  writer.addSection(vw::SceneCacheSection::PerMeshData, imported.perMeshData);
+  writer.addSection(vw::SceneCacheSection::ModelMatrices, imported.meshMatrices);
+  writer.addSection(vw::SceneCacheSection::MaterialPaths, packedMaterials);
+  writer.addSection(vw::SceneCacheSection::Meshlets, imported.meshletData.meshlets);
+  writer.addSection(vw::SceneCacheSection::MeshletVertices, imported.meshletData.vertices);
+  writer.addSection(vw::SceneCacheSection::MeshletTriangles, imported.meshletData.triangles);
+  writer.write(cachePath, key);
+}
+
+SceneView viewOf(const ImportedScene& imported) {
+  std::vector<vw::ArrayProxy<std::byte>> vertexStreams(imported.vertexStreams.begin(), imported.vertexStreams.end());
+  return {vertexStreams,
+          imported.indices16,
+          imported.indices,
+          imported.meshes,
+          imported.lods,
+          imported.perMeshData,
+          imported.meshMatrices,
+          imported.materials,
+          imported.meshletData.meshlets,
+          imported.meshletData.vertices,
+          imported.meshletData.triangles};
+}
+
+SceneView viewOf(const vw::SceneCacheReader& cache, size_t vertexStreamCount) {
+  using Section = vw::SceneCacheSection;
+  std::vector<vw::ArrayProxy<std::byte>> vertexStreams;
+  for (size_t i = 0; i < vertexStreamCount; ++i)
+    vertexStreams.push_back(cache.get<std::byte>(static_cast<Section>(static_cast<size_t>(Section::VertexStream0) + i)));
+  return {vertexStreams,
+          cache.get<uint16_t>(Section::Indices16),
+          cache.get<uint32_t>(Section::Indices32),
+          cache.get<vw::MeshInfo>(Section::Meshes),
+          cache.get<vw::MeshLod>(Section::MeshLods),
+          cache.get<vw::PerMeshData>(Section::PerMeshData),
+          cache.get<glm::mat4>(Section::ModelMatrices),
+          unpackMaterialFiles(cache.get<char>(Section::MaterialPaths)),
+          cache.get<vw::Meshlet>(Section::Meshlets),
+          cache.get<uint32_t>(Section::MeshletVertices),
+          cache.get<uint8_t>(Section::MeshletTriangles)};
+}
+
+vw::Scene::Scene(vw::MemoryAllocator& allocator, vw::StagingBuffer& stagingBuf, const std::filesystem::path& modelPath, const SceneOptions& options) {
+  std::filesystem::path cachePath = modelPath;
+  cachePath += ".vwcache";
+  const uint32_t importFlags = getImportFlags(options);
+  auto cacheKey = vw::SceneCacheKey::fromSource(modelPath, importFlags, getImportOptions(options));
+  mVertexFormat = options.vertexFormat;
+  mVertexInput = vw::getVertexInputDescription(mVertexFormat, options.vertexLayout);
+
+  // On a cache hit the vertex/index streams are staged straight from the mapped cache file and Assimp is never invoked
+  std::optional<ImportedScene> imported;
+  std::optional<vw::SceneCacheReader> cache;
+  if (options.sceneCache)
+    cache = vw::SceneCacheReader::open(cachePath, cacheKey);
+  if (!cache) {
+    imported.emplace(importScene(modelPath, importFlags));
+    if (options.optimizeMeshes)
+      optimizeMeshes(*imported, options.printMeshStats);
+    encodeVertexStreams(*imported, mVertexFormat, mVertexInput);
+    if (options.generateMeshlets)
+      buildMeshlets(*imported);
+    generateLods(*imported, std::min(options.lodCount, vw::kMaxLodCount), options.optimizeMeshes);
+    encodeIndexStreams(*imported);
+    try {
+      if (options.sceneCache)
+        writeSceneCache(*imported, cachePath, cacheKey);
+    } catch (std::exception& err) {
+      std::cerr << "Failed to write scene cache: " << err.what() << std::endl;
+    }
+  }
+  SceneView view = cache ? viewOf(*cache, mVertexInput.bindings.size()) : viewOf(*imported);
+
+  // Materials only hold registry indices, each unique texture file is decoded and uploaded once
+  mMaterials.reserve(view.materials.size());
+  for (const auto& materialFiles : view.materials) {
+    Material& mat = mMaterials.emplace_back();
+    for (auto i = 0; i < vw::TextureType::MaxEnum; ++i) {
+      auto it = materialFiles.textures.find(static_cast<vw::TextureType>(i));
+      if (it != materialFiles.textures.end())
+        mat.textureIndices[i] = mTextures.add(it->second, getTextureDecodeOptions(static_cast<vw::TextureType>(i), options));
       else
-        tex.imageFile = std::make_unique<vw::GenericImageFile>(path);
-    } else
-      tex.imageFile = std::make_unique<vw::DefaultValueFile<glm::vec4>>(glm::vec4{0.0f, 0.0f, 0.0f, 1.0f}, vk::Format::eR8G8B8A8Unorm);
+        mat.textureIndices[i] = mTextures.getDefault(kDefaultTextures[i]);
+    }
+  }
 
-    tex.image.emplace(allocator, tex.imageFile->get()->getFormat(), tex.imageFile->get()->getExtent(), vw::ImageUse::kTexture);
-    tex.imageView.emplace(tex.image->createView());
+  mMeshes.assign(view.meshes.begin(), view.meshes.end());
+  mLods.assign(view.lods.begin(), view.lods.end());
+  for (const auto& mesh : mMeshes)
+    mTotalVertexCount += mesh.vertexCount;
+  mTotalIndexCount = view.indices16.size() + view.indices32.size();
+  mTotalInstanceCount = view.meshMatrices.size();
+
+  // World-space bounds of every instance for LOD selection
+  mMeshInstanceBase.reserve(mMeshes.size());
+  mInstanceBounds.resize(mTotalInstanceCount);
+  for (uint32_t meshIdx = 0; meshIdx < mMeshes.size(); ++meshIdx) {
+    const MeshInfo& mesh = mMeshes[meshIdx];
+    uint32_t instanceBase = view.perMeshData[meshIdx].modelMatrixBaseIndex;
+    mMeshInstanceBase.push_back(instanceBase);
+    for (uint32_t i = 0; i < mesh.instanceCount; ++i) {
+      const glm::mat4& model = view.meshMatrices[instanceBase + i];
+      InstanceBounds& bounds = mInstanceBounds[instanceBase + i];
+      bounds.center = Vec3{model * glm::vec4{mesh.boundsCenter, 1.0f}};
+      bounds.scale = std::max({glm::length(Vec3{model[0]}), glm::length(Vec3{model[1]}), glm::length(Vec3{model[2]})});
+      bounds.radius = mesh.boundsRadius * bounds.scale;
+    }
   }
+
+  // One draw stream per index type, each drawn with a single drawIndexedIndirect. A stream holds at most one draw per LOD of its meshes, and
+  // firstInstance of every draw addresses its instances in the instance stream, which is how the vertex shader finds its mesh and model matrix
+  const std::array<vk::IndexType, 2> streamIndexTypes{vk::IndexType::eUint16, vk::IndexType::eUint32};
+  uint32_t maxDrawCount = 0;
+  for (size_t streamIdx = 0; streamIdx < mDrawStreams.size(); ++streamIdx) {
+    DrawStream& stream = mDrawStreams[streamIdx];
+    stream.indexType = streamIndexTypes[streamIdx];
+    stream.commandOffset = maxDrawCount * sizeof(vk::DrawIndexedIndirectCommand);
+    for (const MeshInfo& mesh : mMeshes)
+      if (mesh.indexType == stream.indexType)
+        stream.maxDrawCount += mesh.lodCount;
+    maxDrawCount += stream.maxDrawCount;
+  }
+
+  // Every vertex stream is a segment of the same buffer, bound once per vertex binding
+  std::vector<vk::DeviceSize> streamSizes;
+  for (const auto& stream : view.vertexStreams)
+    streamSizes.push_back(vw::byteSize(stream));
+  // Static geometry goes straight into host-visible device memory where there is some, otherwise through the staging buffer
+  const bool directUpload = options.directUpload;
+  // Transfer source lets the defragmenter move them
+  mVbo.emplace(allocator, streamSizes, vw::BufferUse::kVertexBuffer | vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_GPU_ONLY, directUpload);
+  mIbo.emplace(allocator, std::initializer_list<vk::DeviceSize>{vw::byteSize(view.indices16), vw::byteSize(view.indices32)},
+               vw::BufferUse::kIndexBuffer | vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_GPU_ONLY, directUpload);
+  mVbo->setDebugInfo(vw::MemoryCategory::Geometry, "Scene vertices");
+  mIbo->setDebugInfo(vw::MemoryCategory::Geometry, "Scene indices");
+  mDrawStreams[0].indexOffset = mIbo->getSegmentDesc(0).offset;
+  mDrawStreams[1].indexOffset = mIbo->getSegmentDesc(1).offset;
+
+  for (size_t i = 0; i < view.vertexStreams.size(); ++i) {
+    mVertexBuffers.push_back(*mVbo);
+    mVertexStreamOffsets.push_back(mVbo->getSegmentDesc(i).offset);
+    stagingBuf.queueBufferWrite(view.vertexStreams[i], *mVbo, i);
+  }
+
+  // The draw commands and the instance stream are rewritten by selectLods, so they live in host-visible memory with one copy per frame slot
+  uint32_t frameSlotCount = std::max(1u, options.frameSlotCount);
+  mInstanceBinding = vw::size32(mVertexInput.bindings);
+  mVertexInput.bindings.emplace_back(mInstanceBinding, static_cast<uint32_t>(sizeof(InstanceData)), vk::VertexInputRate::eInstance);
+  mVertexInput.attributes.emplace_back(static_cast<uint32_t>(vw::kVertexAttributeCount), mInstanceBinding, vk::Format::eR32G32Uint, 0);
+  std::vector<vk::DeviceSize> instanceSlotSizes(frameSlotCount, mTotalInstanceCount * sizeof(InstanceData));
+  std::vector<vk::DeviceSize> indirectSlotSizes(frameSlotCount, maxDrawCount * sizeof(vk::DrawIndexedIndirectCommand));
+  mInstanceBuffer.emplace(allocator, instanceSlotSizes, vk::BufferUsageFlagBits::eVertexBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU);
+  mIndirectBuffer.emplace(allocator, indirectSlotSizes, vk::BufferUsageFlagBits::eIndirectBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU);
+  mInstanceBuffer->setDebugInfo(vw::MemoryCategory::FrameData, "Scene instances");
+  mIndirectBuffer->setDebugInfo(vw::MemoryCategory::FrameData, "Scene draw commands");
+  mSlotDrawCounts.resize(frameSlotCount);
+  mInstanceLods.assign(mTotalInstanceCount, 0);
+  for (uint32_t slot = 0; slot < frameSlotCount; ++slot)
+    writeFrameSlot(slot);
+
+  stagingBuf.queueBufferWrite(view.indices16, *mIbo, 0);
+  stagingBuf.queueBufferWrite(view.indices32, *mIbo, 1);
+  if (view.meshlets.size() > 0) {
+    mMeshlets.assign(view.meshlets.begin(), view.meshlets.end());
+    mMeshletBuffer.emplace(
+        allocator,
+        std::initializer_list<vk::DeviceSize>{vw::byteSize(view.meshlets), vw::byteSize(view.meshletVertices), vw::byteSize(view.meshletTriangles)},
+        vw::BufferUse::kDeviceStorageBuffer | vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_GPU_ONLY, directUpload);
+    mMeshletBuffer->setDebugInfo(vw::MemoryCategory::Geometry, "Scene meshlets");
+    stagingBuf.queueBufferWrite(view.meshlets, *mMeshletBuffer, 0);
+    stagingBuf.queueBufferWrite(view.meshletVertices, *mMeshletBuffer, 1);
+    stagingBuf.queueBufferWrite(view.meshletTriangles, *mMeshletBuffer, 2);
+  }
+
+  mUbo.emplace(allocator,
+               std::initializer_list<vk::DeviceSize>{vw::byteSize(view.perMeshData), vw::byteSize(view.meshMatrices), vw::byteSize(mMaterials)},
+               vw::BufferUse::kStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU);
+  mUbo->setDebugInfo(vw::MemoryCategory::SceneData, "Scene meshes and materials");
+  mUbo->copyToMapped(view.perMeshData, 0);
+  mUbo->copyToMapped(view.meshMatrices, 1);
+  mUbo->copyToMapped(mMaterials, 2);
+
+  mPerMeshShaderDataDesc = mUbo->getSegmentDesc(0);
+  mModelMatrixArrayDesc = mUbo->getSegmentDesc(1);
+  mMaterialArrayDesc = mUbo->getSegmentDesc(2);
+
+  // Everything else is staged by now, so the imported scene or the cache mapping is released before the textures are decoded
+  view = {};
+  imported.reset();
+  cache.reset();
+  {
+    vw::ThreadPool decodePool{options.textureDecodeThreads};
+    mTextures.load(allocator, stagingBuf, decodePool);
+  }
+}
+
+void vw::Scene::addMovable(vw::Defragmenter& defragmenter) {
+  // draw binds the cached vertex buffer handles
+  defragmenter.add(*mVbo, [this] { std::fill(mVertexBuffers.begin(), mVertexBuffers.end(), mVbo->getHandle()); });
+  defragmenter.add(*mIbo);
+  if (mMeshletBuffer)
+    defragmenter.add(*mMeshletBuffer);
+  mTextures.addMovable(defragmenter);
 }
 
-void vw::Material::queueCopies(vw::StagingBuffer& stagingBuffer) {
-  for (auto& texture : mTextures)
-    stagingBuffer.queueImageCopy(*(texture.imageFile->get()), texture.image.value());
+void vw::Scene::selectLods(uint32_t frameSlot, const LodSelection& selection) {
+  for (uint32_t meshIdx = 0; meshIdx < mMeshes.size(); ++meshIdx) {
+    const MeshInfo& mesh = mMeshes[meshIdx];
+    for (uint32_t i = 0; i < mesh.instanceCount; ++i) {
+      uint32_t instanceIdx = mMeshInstanceBase[meshIdx] + i;
+      const InstanceBounds& bounds = mInstanceBounds[instanceIdx];
+      // Distance to the nearest point of the bounding sphere, the error is projected as if it were there
+      float distance = std::max(glm::length(bounds.center - selection.cameraPos) - bounds.radius, 1e-4f);
+      float pixelsPerModelUnit = bounds.scale * selection.pixelsPerUnit / distance;
+      uint32_t lod = 0;
+      while (lod + 1 < mesh.lodCount && mLods[mesh.firstLod + lod + 1].error * pixelsPerModelUnit <= selection.maxPixelError)
+        ++lod;
+      mInstanceLods[instanceIdx] = static_cast<uint8_t>(lod);
+    }
+  }
+  writeFrameSlot(frameSlot);
 }
 
-std::array<vk::DescriptorImageInfo, 3> vw::Material::getTextureDescriptorInfos(vk::Sampler sampler) const {
-  return {vk::DescriptorImageInfo{sampler, mTextures[vw::TextureType::Diffuse].imageView.value(), vk::ImageLayout::eShaderReadOnlyOptimal},
-          vk::DescriptorImageInfo{sampler, mTextures[vw::TextureType::Normals].imageView.value(), vk::ImageLayout::eShaderReadOnlyOptimal},
-          vk::DescriptorImageInfo{sampler, mTextures[vw::TextureType::Specular].imageView.value(), vk::ImageLayout::eShaderReadOnlyOptimal}};
+void vw::Scene::writeFrameSlot(uint32_t frameSlot) {
+  // Instances of a mesh that picked the same LOD share one draw and a contiguous run of the instance stream
+  std::vector<uint32_t> lodFirstInstance(mLods.size(), 0);
+  for (uint32_t meshIdx = 0; meshIdx < mMeshes.size(); ++meshIdx)
+    for (uint32_t i = 0; i < mMeshes[meshIdx].instanceCount; ++i)
+      ++lodFirstInstance[mMeshes[meshIdx].firstLod + mInstanceLods[mMeshInstanceBase[meshIdx] + i]];
+
+  std::array<std::vector<vk::DrawIndexedIndirectCommand>, 2> drawCommands;
+  uint32_t instanceCursor = 0;
+  for (size_t streamIdx = 0; streamIdx < mDrawStreams.size(); ++streamIdx) {
+    for (const MeshInfo& mesh : mMeshes) {
+      if (mesh.indexType != mDrawStreams[streamIdx].indexType)
+        continue;
+      for (uint32_t lodIdx = mesh.firstLod; lodIdx < mesh.firstLod + mesh.lodCount; ++lodIdx) {
+        uint32_t instanceCount = lodFirstInstance[lodIdx];
+        lodFirstInstance[lodIdx] = instanceCursor;
+        if (instanceCount == 0)
+          continue;
+        const MeshLod& lod = mLods[lodIdx];
+        drawCommands[streamIdx].push_back({lod.indexCount, instanceCount, lod.firstIndex, static_cast<int32_t>(mesh.vertexOffset), instanceCursor});
+        instanceCursor += instanceCount;
+      }
+    }
+    mSlotDrawCounts[frameSlot][streamIdx] = vw::size32(drawCommands[streamIdx]);
+  }
+
+  std::vector<InstanceData> instances(mTotalInstanceCount);
+  for (uint32_t meshIdx = 0; meshIdx < mMeshes.size(); ++meshIdx) {
+    for (uint32_t i = 0; i < mMeshes[meshIdx].instanceCount; ++i) {
+      uint32_t instanceIdx = mMeshInstanceBase[meshIdx] + i;
+      instances[lodFirstInstance[mMeshes[meshIdx].firstLod + mInstanceLods[instanceIdx]]++] = {instanceIdx, meshIdx};
+    }
+  }
+
+  if (!instances.empty())
+    mInstanceBuffer->copyToMapped(instances, frameSlot);
+  for (size_t streamIdx = 0; streamIdx < mDrawStreams.size(); ++streamIdx)
+    if (!drawCommands[streamIdx].empty())
+      mIndirectBuffer->copyToMapped(drawCommands[streamIdx], frameSlot, mDrawStreams[streamIdx].commandOffset);
 }
 
 vw::AABB computeAABB(const std::vector<vw::Vec3>& positions) {
@@ -0,0 +1,64 @@
+#include "vkscenecache.hpp"
+#include <cstring>
+#include <fstream>
+
+namespace {
+constexpr uint64_t kSectionAlignment = 16;
+}
+
+vw::SceneCacheKey vw::SceneCacheKey::fromSource(const std::filesystem::path& sourcePath, uint32_t importFlags, uint32_t importOptions) {
+  SceneCacheKey key;
+  key.sourceSize = std::filesystem::file_size(sourcePath);
+  key.sourceWriteTime = static_cast<int64_t>(std::filesystem::last_write_time(sourcePath).time_since_epoch().count());
+  key.importFlags = importFlags;
+  key.importOptions = importOptions;
+  return key;
+}
+
+void vw::SceneCacheWriter::write(const std::filesystem::path& path, const SceneCacheKey& key) const {
+  detail::SceneCacheHeader header;
+  header.key = key;
+  uint64_t offset = sizeof(header);
+  for (size_t i = 0; i < mSections.size(); ++i) {
+    alignTo(offset, kSectionAlignment);
+    header.sections[i] = {offset, mSections[i].size};
+    offset += mSections[i].size;
+  }
+
+  std::filesystem::path tmpPath = path;
+  tmpPath += ".tmp";
+  {
+    std::ofstream file{tmpPath, std::ios::binary | std::ios::trunc};
+    if (!file)
+      throw std::runtime_error("Could not create scene cache " + tmpPath.string());
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t written = sizeof(header);
+    for (size_t i = 0; i < mSections.size(); ++i) {
+      const char padding[kSectionAlignment] = {};
+      file.write(padding, static_cast<std::streamsize>(header.sections[i].offset - written));
+      if (mSections[i].size > 0)
+        file.write(reinterpret_cast<const char*>(mSections[i].data), static_cast<std::streamsize>(mSections[i].size));
+      written = header.sections[i].offset + mSections[i].size;
+    }
+    if (!file)
+      throw std::runtime_error("Error writing scene cache " + tmpPath.string());
+  }
+  std::filesystem::remove(path);
+  std::filesystem::rename(tmpPath, path);
+}
+
+std::optional<vw::SceneCacheReader> vw::SceneCacheReader::open(const std::filesystem::path& path, const SceneCacheKey& key) {
+  if (!std::filesystem::is_regular_file(path) || std::filesystem::file_size(path) < sizeof(detail::SceneCacheHeader))
+    return {};
+
+  vw::MappedFile file{path, vw::FileAccess::Sequential};
+  detail::SceneCacheHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (header.magic != detail::SceneCacheHeader::kMagic || header.version != kSceneCacheVersion || !(header.key == key))
+    return {};
+  for (const auto& section : header.sections) {
+    if (section.offset % kSectionAlignment != 0 || section.offset + section.size > file.size())
+      return {};
+  }
+  return SceneCacheReader{std::move(file), header};
+}
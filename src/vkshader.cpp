@@ -5,11 +5,20 @@
 #include <stdexcept>
 #include <vector>
 
-std::vector<uint32_t> vw::loadShader(std::filesystem::path path) {
-  return vw::loadBinaryFile<uint32_t>(path);
+vw::MappedFile vw::loadShader(std::filesystem::path path) {
+  vw::MappedFile file{path};
+  if (file.size() == 0 || file.size() % sizeof(uint32_t) != 0)
+    throw std::runtime_error("Shader file " + path.string() + " is not a valid SPIR-V binary");
+  return file;
 }
 
 vw::Shader::Shader(vk::ShaderStageFlagBits stage, vw::ArrayProxy<uint32_t> binary, vw::ArrayProxy<ShaderIOBinding> ioBindings, uint32_t pushConstantSize)
     : mIOBindings{ioBindings.copyToVec()}, mPushConstantSize{pushConstantSize}, mStage{stage} {
   mHandle = vw::g::device.createShaderModule(vk::ShaderModuleCreateInfo{vk::ShaderModuleCreateFlags{}, binary.byteSize(), binary.data()});
-}
\ No newline at end of file
+}
+
+vw::Shader::Shader(vk::ShaderStageFlagBits stage, const vw::MappedFile& binary, vw::ArrayProxy<ShaderIOBinding> ioBindings, uint32_t pushConstantSize)
+    : Shader(stage,
+             vw::ArrayProxy<uint32_t>{reinterpret_cast<const uint32_t*>(binary.data()), static_cast<uint32_t>(binary.size() / sizeof(uint32_t))},
+             ioBindings,
+             pushConstantSize) {}
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "vksimplify.hpp"
+#include <algorithm>
+#include <cmath>
+#include <glm/geometric.hpp>
+#include <unordered_map>
+
+namespace {
+// Symmetric 4x4 matrix of the summed squared plane distances, weighted by triangle area
+struct Quadric {
+  double a00 = 0, a01 = 0, a02 = 0, a03 = 0, a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
+  double weight = 0;
+
+  static Quadric fromPlane(const vw::Vec3& n, float d, double weight) {
+    Quadric q;
+    q.a00 = weight * n.x * n.x, q.a01 = weight * n.x * n.y, q.a02 = weight * n.x * n.z, q.a03 = weight * n.x * d;
+    q.a11 = weight * n.y * n.y, q.a12 = weight * n.y * n.z, q.a13 = weight * n.y * d;
+    q.a22 = weight * n.z * n.z, q.a23 = weight * n.z * d;
+    q.a33 = weight * d * d;
+    q.weight = weight;
+    return q;
+  }
+  Quadric& operator+=(const Quadric& o) {
+    a00 += o.a00, a01 += o.a01, a02 += o.a02, a03 += o.a03, a11 += o.a11, a12 += o.a12, a13 += o.a13, a22 += o.a22, a23 += o.a23, a33 += o.a33;
+    weight += o.weight;
+    return *this;
+  }
+  // Weighted mean squared distance of p to the accumulated planes
+  double evaluate(const vw::Vec3& p) const {
+    double x = p.x, y = p.y, z = p.z;
+    double r = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x + a11 * y * y + 2 * a12 * y * z + 2 * a13 * y + a22 * z * z + 2 * a23 * z + a33;
+    return (weight > 0) ? std::abs(r) / weight : 0.0;
+  }
+};
+
+struct Collapse {
+  double cost;
+  uint32_t from;
+  uint32_t to;
+};
+
+uint64_t edgeKey(uint32_t a, uint32_t b) {
+  return (static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b);
+}
+
+// Moving from onto to must not turn any of the remaining triangles around from inside out
+bool flipsTriangle(const std::vector<uint32_t>& indices,
+                   const std::vector<uint32_t>& adjOffsets,
+                   const std::vector<uint32_t>& adjTriangles,
+                   vw::ArrayProxy<vw::Vec3> positions,
+                   uint32_t from,
+                   uint32_t to) {
+  for (uint32_t i = adjOffsets[from]; i < adjOffsets[from + 1]; ++i) {
+    const uint32_t* tri = &indices[3 * adjTriangles[i]];
+    if (tri[0] == to || tri[1] == to || tri[2] == to)
+      continue;
+    vw::Vec3 p[3], moved[3];
+    for (int k = 0; k < 3; ++k) {
+      p[k] = positions[tri[k]];
+      moved[k] = (tri[k] == from) ? positions[to] : p[k];
+    }
+    vw::Vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+    vw::Vec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+    if (glm::dot(before, after) <= 0.0f)
+      return true;
+  }
+  return false;
+}
+}  // namespace
+
+std::vector<uint32_t> vw::simplifyMesh(ArrayProxy<uint32_t> indices, ArrayProxy<Vec3> positions, uint32_t targetIndexCount, float maxError, float& error) {
+  const uint32_t vertexCount = positions.size();
+  std::vector<uint32_t> result(indices.begin(), indices.end());
+  error = 0.0f;
+
+  // Edges not shared by exactly two triangles are borders or seams where the attribute-split vertices would tear apart
+  std::vector<bool> locked(vertexCount, false);
+  {
+    std::unordered_map<uint64_t, uint32_t> edgeUse;
+    edgeUse.reserve(result.size());
+    for (size_t t = 0; t < result.size(); t += 3)
+      for (int k = 0; k < 3; ++k)
+        ++edgeUse[edgeKey(result[t + k], result[t + (k + 1) % 3])];
+    for (const auto& [key, count] : edgeUse) {
+      if (count != 2) {
+        locked[static_cast<uint32_t>(key >> 32)] = true;
+        locked[static_cast<uint32_t>(key & 0xffffffff)] = true;
+      }
+    }
+  }
+
+  std::vector<Quadric> quadrics(vertexCount);
+  for (size_t t = 0; t < result.size(); t += 3) {
+    const Vec3& p0 = positions[result[t]];
+    Vec3 normal = glm::cross(positions[result[t + 1]] - p0, positions[result[t + 2]] - p0);
+    float area = glm::length(normal);
+    if (area == 0.0f)
+      continue;
+    normal /= area;
+    Quadric q = Quadric::fromPlane(normal, -glm::dot(normal, p0), area);
+    for (int k = 0; k < 3; ++k)
+      quadrics[result[t + k]] += q;
+  }
+
+  const double maxCost = static_cast<double>(maxError) * maxError;
+  double worstCost = 0.0;
+  std::vector<uint32_t> adjOffsets, adjTriangles, collapseTarget(vertexCount);
+  std::vector<uint64_t> edges;
+  std::vector<Collapse> collapses;
+  std::vector<bool> touched;
+
+  // Each pass collapses a batch of the cheapest independent edges, then the index list and the adjacency are rebuilt
+  while (result.size() > targetIndexCount) {
+    adjOffsets.assign(vertexCount + 1, 0);
+    for (uint32_t index : result)
+      ++adjOffsets[index + 1];
+    for (uint32_t v = 0; v < vertexCount; ++v)
+      adjOffsets[v + 1] += adjOffsets[v];
+    adjTriangles.resize(result.size());
+    {
+      std::vector<uint32_t> fill(adjOffsets.begin(), adjOffsets.end() - 1);
+      for (uint32_t i = 0; i < result.size(); ++i)
+        adjTriangles[fill[result[i]]++] = i / 3;
+    }
+
+    edges.clear();
+    for (size_t t = 0; t < result.size(); t += 3)
+      for (int k = 0; k < 3; ++k)
+        edges.push_back(edgeKey(result[t + k], result[t + (k + 1) % 3]));
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    collapses.clear();
+    for (uint64_t edge : edges) {
+      uint32_t a = static_cast<uint32_t>(edge >> 32), b = static_cast<uint32_t>(edge & 0xffffffff);
+      Quadric merged = quadrics[a];
+      merged += quadrics[b];
+      if (!locked[a])
+        collapses.push_back({merged.evaluate(positions[b]), a, b});
+      if (!locked[b])
+        collapses.push_back({merged.evaluate(positions[a]), b, a});
+    }
+    std::sort(collapses.begin(), collapses.end(), [](const Collapse& l, const Collapse& r) { return l.cost < r.cost; });
+
+    for (uint32_t v = 0; v < vertexCount; ++v)
+      collapseTarget[v] = v;
+    touched.assign(vertexCount, false);
+    const size_t trianglesToRemove = (result.size() - targetIndexCount) / 3;
+    size_t removedTriangles = 0;
+    bool collapsed = false;
+    for (const Collapse& collapse : collapses) {
+      if (collapse.cost > maxCost || removedTriangles >= trianglesToRemove)
+        break;
+      if (touched[collapse.from] || touched[collapse.to])
+        continue;
+      if (flipsTriangle(result, adjOffsets, adjTriangles, positions, collapse.from, collapse.to))
+        continue;
+
+      // Every vertex around from is frozen for the rest of the pass so the flip test above stays valid
+      for (uint32_t i = adjOffsets[collapse.from]; i < adjOffsets[collapse.from + 1]; ++i) {
+        const uint32_t* tri = &result[3 * adjTriangles[i]];
+        if (tri[0] == collapse.to || tri[1] == collapse.to || tri[2] == collapse.to)
+          ++removedTriangles;
+        for (int k = 0; k < 3; ++k)
+          touched[tri[k]] = true;
+      }
+      collapseTarget[collapse.from] = collapse.to;
+      quadrics[collapse.to] += quadrics[collapse.from];
+      worstCost = std::max(worstCost, collapse.cost);
+      collapsed = true;
+    }
+    if (!collapsed)
+      break;
+
+    size_t writePos = 0;
+    for (size_t t = 0; t < result.size(); t += 3) {
+      uint32_t a = collapseTarget[result[t]], b = collapseTarget[result[t + 1]], c = collapseTarget[result[t + 2]];
+      if (a == b || b == c || a == c)
+        continue;
+      result[writePos++] = a;
+      result[writePos++] = b;
+      result[writePos++] = c;
+    }
+    result.resize(writePos);
+  }
+
+  error = static_cast<float>(std::sqrt(worstCost));
+  return result;
+}
@@ -1,25 +1,288 @@
 #include "vktexture.hpp"
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <utility>
+#include "vkbcn.hpp"
+#include "vkdds.hpp"
+#include "vkdefrag.hpp"
+#include "vkfile.hpp"
+#include "vkmipgen.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
-vw::GenericImageFile::GenericImageFile(const std::filesystem::path& path, int requiredCompCount) {
-  if (!std::filesystem::exists(path))
-    throw std::runtime_error("Texture file " + path.string() + " does not exist!");
-  if (!std::filesystem::is_regular_file(path))
-    throw std::runtime_error("Texture file " + path.string() + " is not a regular file!");
+vw::GenericImageFile::GenericImageFile(const std::filesystem::path& path, int requiredCompCount, bool generateMips, bool srgb)
+    : mPath{path}, mFile{path, vw::FileAccess::Sequential}, mSrgb{srgb} {
+  if (mFile.size() > static_cast<size_t>(std::numeric_limits<int>::max()))
+    throw std::runtime_error("Texture file " + path.string() + " is too large!");
 
   int width, height, comp;
-  mDataStart = reinterpret_cast<std::byte*>(stbi_load(path.string().c_str(), &width, &height, &comp, requiredCompCount));
-  mSize = static_cast<uint64_t>(width) * static_cast<uint64_t>(height) * static_cast<uint64_t>(requiredCompCount);
-  mExtent.width = width;
-  mExtent.height = height;
-  mExtent.depth = 1;
+  if (!stbi_info_from_memory(reinterpret_cast<const stbi_uc*>(mFile.data()), static_cast<int>(mFile.size()), &width, &height, &comp))
+    throw std::runtime_error("Could not decode texture file " + path.string() + ": " + stbi_failure_reason());
+  if (requiredCompCount == 0)
+    requiredCompCount = comp;
+  // There is no widely supported 3 channel 8-bit format
+  mComponentCount = (requiredCompCount == 3) ? 4 : static_cast<uint32_t>(requiredCompCount);
+  mExtent = vk::Extent3D{static_cast<uint32_t>(width), static_cast<uint32_t>(height), 1};
+  if (generateMips)
+    mMipLevels = vw::getMaxMipLevels(mExtent);
 }
 
-vw::GenericImageFile::~GenericImageFile() {
-  stbi_image_free(mDataStart);
+void vw::GenericImageFile::loadData(std::byte* dest) const {
+  // stb_image always allocates its output, it is copied out and freed right away. The mips are filtered from the decoded copy and only
+  // written to dest, staging memory is write combined
+  int width, height, comp;
+  std::unique_ptr<stbi_uc, decltype(&stbi_image_free)> decoded{
+      stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(mFile.data()), static_cast<int>(mFile.size()), &width, &height, &comp,
+                            static_cast<int>(mComponentCount)),
+      &stbi_image_free};
+  if (decoded == nullptr)
+    throw std::runtime_error("Could not decode texture file " + mPath.string() + ": " + stbi_failure_reason());
+  if (static_cast<uint32_t>(width) != mExtent.width || static_cast<uint32_t>(height) != mExtent.height)
+    throw std::runtime_error("Texture file " + mPath.string() + " changed while loading");
+
+  const std::byte* base = reinterpret_cast<const std::byte*>(decoded.get());
+  const size_t baseSize = getSubresourceSize(0);
+  std::memcpy(dest, base, baseSize);
+  if (mMipLevels > 1)
+    vw::generateMipChain(base, mExtent.width, mExtent.height, mComponentCount, mSrgb, dest + baseSize);
+}
+
+namespace {
+// Bump whenever the encoders or the mip filter change their output
+constexpr uint32_t kTextureCacheVersion = 2;
+
+struct TextureCacheHeader {
+  static constexpr uint32_t kMagic = 0x43545756;  // "VWTC"
+  uint32_t magic = kMagic;
+  uint32_t version = kTextureCacheVersion;
+  // Source file and the decode options that change the encoded data, any mismatch invalidates the cache
+  uint64_t sourceSize = 0;
+  int64_t sourceWriteTime = 0;
+  uint32_t options = 0;
+  vk::Format format = vk::Format::eUndefined;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t mipLevels = 0;
+  uint32_t _pad = 0;
+  uint64_t dataSize = 0;
+  bool sameSource(const TextureCacheHeader& other) const {
+    return sourceSize == other.sourceSize && sourceWriteTime == other.sourceWriteTime && options == other.options;
+  }
+};
+
+std::unique_ptr<vw::ImageFile> readTextureCache(const std::filesystem::path& cachePath, const TextureCacheHeader& key) {
+  if (!std::filesystem::is_regular_file(cachePath) || std::filesystem::file_size(cachePath) < sizeof(TextureCacheHeader))
+    return nullptr;
+  vw::MappedFile file{cachePath, vw::FileAccess::Sequential};
+  TextureCacheHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (header.magic != TextureCacheHeader::kMagic || header.version != kTextureCacheVersion || !header.sameSource(key) ||
+      header.dataSize != file.size() - sizeof(header))
+    return nullptr;
+  auto imageFile = std::make_unique<vw::CompressedImageFile>(header.format, vk::Extent3D{header.width, header.height, 1}, header.mipLevels,
+                                                             std::move(file), sizeof(header));
+  if (imageFile->getSubresourcesSize() != header.dataSize)
+    return nullptr;
+  return imageFile;
+}
+
+void writeTextureCache(const std::filesystem::path& cachePath, const TextureCacheHeader& header, const std::vector<std::byte>& data) {
+  std::filesystem::path tmpPath = cachePath;
+  tmpPath += ".tmp";
+  {
+    std::ofstream file{tmpPath, std::ios::binary | std::ios::trunc};
+    if (!file)
+      throw std::runtime_error("Could not create texture cache " + tmpPath.string());
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    if (!file)
+      throw std::runtime_error("Error writing texture cache " + tmpPath.string());
+  }
+  std::filesystem::remove(cachePath);
+  std::filesystem::rename(tmpPath, cachePath);
+}
+
+// The cache is shared by all sources, the file name keeps the stem readable and a hash of the full path tells equally named files apart
+std::filesystem::path getTextureCachePath(const std::filesystem::path& path, const vw::TextureDecodeOptions& options) {
+  // FNV-1a, std::hash may differ between builds
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : std::filesystem::weakly_canonical(path).u8string()) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3ull;
+  }
+  char hashString[17];
+  std::snprintf(hashString, sizeof(hashString), "%016llx", static_cast<unsigned long long>(hash));
+  std::filesystem::path cachePath = options.cacheDirectory / path.stem();
+  cachePath += std::string{"."} + hashString;
+  // Linear and sRGB decodes of the same file get their own cache, otherwise they would keep overwriting each other
+  cachePath += (options.compression == vw::TextureCompression::Normal) ? ".normal" : ".color";
+  cachePath += options.srgb ? ".srgb.vwtex" : ".vwtex";
+  return cachePath;
+}
+
+// Decodes with a CPU mip chain and block compresses every level, or maps the result of an earlier run
+std::unique_ptr<vw::ImageFile> loadCompressedImageFile(const std::filesystem::path& path, const vw::TextureDecodeOptions& options) {
+  const bool useCache = !options.cacheDirectory.empty();
+  const std::filesystem::path cachePath = useCache ? getTextureCachePath(path, options) : std::filesystem::path{};
+  TextureCacheHeader header;
+  header.sourceSize = std::filesystem::file_size(path);
+  header.sourceWriteTime = static_cast<int64_t>(std::filesystem::last_write_time(path).time_since_epoch().count());
+  header.options = static_cast<uint32_t>(options.compression) | (static_cast<uint32_t>(options.srgb) << 8);
+  try {
+    if (useCache) {
+      if (auto cached = readTextureCache(cachePath, header))
+        return cached;
+    }
+  } catch (std::exception& err) {
+    std::cerr << "Failed to read texture cache: " << err.what() << std::endl;
+  }
+
+  // Grey color textures keep their single channel in BC4, everything else is encoded from RGBA
+  int componentCount = 4;
+  if (options.compression == vw::TextureCompression::Color) {
+    vw::MappedFile file{path};
+    int width, height, comp;
+    if (stbi_info_from_memory(reinterpret_cast<const stbi_uc*>(file.data()), static_cast<int>(file.size()), &width, &height, &comp) && comp == 1)
+      componentCount = 1;
+  }
+  vw::GenericImageFile decoded{path, componentCount, true, options.srgb};
+  std::vector<std::byte> levels(decoded.dataSize());
+  decoded.loadData(levels.data());
+  vk::Format format = vk::Format::eBc5UnormBlock;
+  if (componentCount == 1) {
+    format = vk::Format::eBc4UnormBlock;
+  } else if (options.compression == vw::TextureCompression::Color) {
+    bool opaque = true;
+    for (size_t i = 3; i < decoded.getSubresourceSize(0) && opaque; i += 4)
+      opaque = (levels[i] == std::byte{255});
+    format = opaque ? vk::Format::eBc1RgbaUnormBlock : vk::Format::eBc3UnormBlock;
+  }
+
+  std::vector<std::byte> encoded;
+  const std::byte* level = levels.data();
+  for (uint32_t mip = 0; mip < decoded.getMipLevels(); ++mip) {
+    vk::Extent3D extent = vw::getMipExtent(decoded.getExtent(), mip);
+    std::vector<std::byte> blocks = vw::compressImage(level, extent.width, extent.height, decoded.getComponentCount(), format);
+    encoded.insert(encoded.end(), blocks.begin(), blocks.end());
+    level += static_cast<size_t>(extent.width) * extent.height * decoded.getComponentCount();
+  }
+
+  header.format = format;
+  header.width = decoded.getExtent().width;
+  header.height = decoded.getExtent().height;
+  header.mipLevels = decoded.getMipLevels();
+  header.dataSize = encoded.size();
+  try {
+    if (useCache) {
+      std::filesystem::create_directories(options.cacheDirectory);
+      writeTextureCache(cachePath, header, encoded);
+    }
+  } catch (std::exception& err) {
+    // Only costs the next run another encode
+    std::cerr << "Failed to write texture cache: " << err.what() << std::endl;
+  }
+  return std::make_unique<vw::CompressedImageFile>(format, decoded.getExtent(), decoded.getMipLevels(), std::move(encoded));
+}
+}  // namespace
+
+std::unique_ptr<vw::ImageFile> vw::loadImageFile(const std::filesystem::path& path, const TextureDecodeOptions& options) {
+  if (path.extension() == ".dds")
+    return std::make_unique<vw::dds::DDSFile>(path);
+  if (options.compression != TextureCompression::None)
+    return loadCompressedImageFile(path, options);
+  return std::make_unique<vw::GenericImageFile>(path, options.componentCount, options.mipGeneration == MipGeneration::Cpu, options.srgb);
+}
+
+uint32_t vw::TextureRegistry::add(const std::filesystem::path& path, const TextureDecodeOptions& options) {
+  std::filesystem::path canonicalPath = std::filesystem::weakly_canonical(path);
+  std::string key = canonicalPath.u8string() + "|" + std::to_string(options.componentCount) + "|" + std::to_string(static_cast<int>(options.mipGeneration)) + "|" +
+                    std::to_string(options.srgb) + "|" + std::to_string(static_cast<int>(options.compression));
+  auto [it, inserted] = mIndexByKey.try_emplace(key, size());
+  if (inserted)
+    mEntries.push_back({canonicalPath, options, nullptr});
+  return it->second;
+}
+
+uint32_t vw::TextureRegistry::add(std::unique_ptr<vw::ImageFile> imageFile) {
+  mEntries.push_back({{}, {}, std::move(imageFile)});
+  return size() - 1;
+}
+
+uint32_t vw::TextureRegistry::getDefault(DefaultTexture type) {
+  using Texel = std::array<uint8_t, 4>;
+  static constexpr std::array<Texel, static_cast<size_t>(DefaultTexture::MaxEnum)> kDefaultValues{
+      Texel{0, 0, 0, 255},        // Black
+      Texel{128, 128, 255, 255},  // FlatNormal: +Z in tangent space
+      Texel{255, 128, 0, 255},    // Specular: no occlusion, medium roughness, dielectric
+  };
+  auto& index = mDefaults[static_cast<size_t>(type)];
+  if (!index)
+    index = add(std::make_unique<vw::DefaultValueFile<Texel>>(kDefaultValues[static_cast<size_t>(type)], vk::Format::eR8G8B8A8Unorm));
+  return index.value();
+}
+
+void vw::TextureRegistry::load(vw::MemoryAllocator& allocator, vw::StagingBuffer& stagingBuffer, vw::ThreadPool& decodePool) {
+  std::vector<std::future<std::unique_ptr<vw::ImageFile>>> opened(mEntries.size());
+  for (size_t i = 0; i < mEntries.size(); ++i) {
+    if (!mEntries[i].imageFile)
+      opened[i] = decodePool.submit([path = mEntries[i].path, options = mEntries[i].options] { return vw::loadImageFile(path, options); });
+  }
+
+  // Every file then decodes straight into its reserved staging range on the pool, all writes have to land before the staging buffer is
+  // flushed to make room
+  std::vector<std::future<void>> pendingWrites;
+  auto finishWrites = [&pendingWrites] {
+    for (auto& write : pendingWrites)
+      write.get();
+    pendingWrites.clear();
+  };
+  mGpuTextures.emplace(mEntries.size());
+  for (size_t i = 0; i < mEntries.size(); ++i) {
+    auto& entry = mEntries[i];
+    if (opened[i].valid())
+      entry.imageFile = opened[i].get();
+    uint32_t generatedMipLevels = 0;
+    if (entry.options.mipGeneration == MipGeneration::Gpu && entry.imageFile->getMipLevels() == 1 && stagingBuffer.canGenerateMips(entry.imageFile->getFormat()))
+      generatedMipLevels = vw::getMaxMipLevels(entry.imageFile->getExtent()) - 1;
+    auto& texture = mGpuTextures->emplace_back(allocator, *entry.imageFile, entry.imageFile->getMipLevels() + generatedMipLevels);
+    texture.image.setDebugInfo(vw::MemoryCategory::Texture, entry.path.empty() ? "DefaultTexture" : entry.path.filename().u8string());
+    if (!stagingBuffer.fitsImage(*entry.imageFile))
+      finishWrites();
+    // Files larger than a staging region are copied in bands on this thread
+    if (!stagingBuffer.fitsRegion(*entry.imageFile)) {
+      stagingBuffer.queueImageCopy(*entry.imageFile, texture.image, vk::ImageLayout::eUndefined, vk::ImageLayout::eShaderReadOnlyOptimal,
+                                   vw::kDefaultImageLayers, {}, generatedMipLevels);
+      entry.imageFile.reset();
+      continue;
+    }
+    std::byte* staged = stagingBuffer.reserveImageCopy(*entry.imageFile, texture.image, vk::ImageLayout::eUndefined, vk::ImageLayout::eShaderReadOnlyOptimal,
+                                                       vw::kDefaultImageLayers, {}, generatedMipLevels);
+    // The file and whatever it holds (mapping, encoded blocks) is freed on the worker as soon as its data is staged
+    pendingWrites.push_back(decodePool.submit([imageFile = std::move(entry.imageFile), staged] { vw::StagingBuffer::loadStagedImage(*imageFile, staged); }));
+  }
+  finishWrites();
+}
+
+std::vector<vk::DescriptorImageInfo> vw::TextureRegistry::getDescriptorInfos(vk::Sampler sampler) const {
+  std::vector<vk::DescriptorImageInfo> infos;
+  infos.reserve(mGpuTextures->size());
+  for (const auto& texture : mGpuTextures.value())
+    infos.emplace_back(sampler, texture.view, vk::ImageLayout::eShaderReadOnlyOptimal);
+  return infos;
+}
+
+void vw::TextureRegistry::addMovable(vw::Defragmenter& defragmenter) {
+  for (auto& texture : mGpuTextures.value()) {
+    defragmenter.add(texture.image, vk::ImageLayout::eShaderReadOnlyOptimal, [&defragmenter, &texture] {
+      // Frames in flight may still sample the old view
+      defragmenter.retire(std::make_shared<vw::ImageView>(std::exchange(texture.view, texture.createView())));
+    });
+  }
 }
 
 vw::Sampler::Sampler(vk::Filter filter, vk::SamplerAddressMode addressMode, float maxAnisotropy) {
@@ -35,6 +298,8 @@ vw::Sampler::Sampler(vk::Filter filter, vk::SamplerAddressMode addressMode, floa
   createInfo.compareEnable = VK_FALSE;
   createInfo.compareOp = vk::CompareOp::eNever;
   createInfo.borderColor = vk::BorderColor::eFloatOpaqueBlack;
+  createInfo.minLod = 0.0f;
+  createInfo.maxLod = VK_LOD_CLAMP_NONE;
 
   mHandle = vw::g::device.createSampler(createInfo);
 }
@@ -0,0 +1,36 @@
+#include "vkthreadpool.hpp"
+#include <algorithm>
+
+vw::ThreadPool::ThreadPool(uint32_t threadCount) {
+  if (threadCount == 0)
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  mWorkers.reserve(threadCount);
+  for (uint32_t i = 0; i < threadCount; ++i)
+    mWorkers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+vw::ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mStopping = true;
+  }
+  mTaskAvailable.notify_all();
+  for (auto& worker : mWorkers)
+    worker.join();
+}
+
+void vw::ThreadPool::workerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock{mMutex};
+      mTaskAvailable.wait(lock, [this] { return mStopping || !mTasks.empty(); });
+      // Queued tasks are drained before shutting down so no future is left without a value
+      if (mTasks.empty())
+        return;
+      task = std::move(mTasks.front());
+      mTasks.pop();
+    }
+    task();
+  }
+}
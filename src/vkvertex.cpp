@@ -0,0 +1,118 @@
+#include "vkvertex.hpp"
+#include <cstring>
+#include <glm/common.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/vec4.hpp>
+
+namespace {
+constexpr std::array<vk::Format, vw::kVertexAttributeCount> kFloatFormats{vk::Format::eR32G32B32Sfloat, vk::Format::eR32G32B32Sfloat,
+                                                                          vk::Format::eR32G32B32Sfloat, vk::Format::eR32G32B32Sfloat};
+constexpr std::array<uint32_t, vw::kVertexAttributeCount> kFloatSizes{12, 12, 12, 12};
+constexpr std::array<vk::Format, vw::kVertexAttributeCount> kCompactFormats{vk::Format::eR16G16B16A16Unorm, vk::Format::eR16G16Snorm,
+                                                                            vk::Format::eR16G16Snorm, vk::Format::eR16G16Sfloat};
+constexpr std::array<uint32_t, vw::kVertexAttributeCount> kCompactSizes{8, 4, 4, 4};
+
+// Octahedral mapping of a unit vector onto [-1, 1]^2, decoded by decodeOctahedral in offscreen.vert
+glm::vec2 encodeOctahedral(glm::vec3 n) {
+  float l1Norm = glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+  if (l1Norm == 0.0f)
+    return glm::vec2{0.0f};
+  n /= l1Norm;
+  glm::vec2 e{n.x, n.y};
+  if (n.z < 0.0f) {
+    glm::vec2 signs{e.x >= 0.0f ? 1.0f : -1.0f, e.y >= 0.0f ? 1.0f : -1.0f};
+    e = (1.0f - glm::abs(glm::vec2{e.y, e.x})) * signs;
+  }
+  return e;
+}
+}  // namespace
+
+vk::Format vw::getAttributeFormat(VertexFormat format, VertexAttribute attribute) {
+  const auto& formats = (format == VertexFormat::Compact) ? kCompactFormats : kFloatFormats;
+  return formats[static_cast<size_t>(attribute)];
+}
+
+uint32_t vw::getAttributeSize(VertexFormat format, VertexAttribute attribute) {
+  const auto& sizes = (format == VertexFormat::Compact) ? kCompactSizes : kFloatSizes;
+  return sizes[static_cast<size_t>(attribute)];
+}
+
+uint32_t vw::getAttributeBinding(VertexLayout layout, VertexAttribute attribute) {
+  switch (layout) {
+    case VertexLayout::Interleaved:
+      return 0;
+    case VertexLayout::PositionSplit:
+      return (attribute == VertexAttribute::Position) ? 0 : 1;
+    default:
+      return static_cast<uint32_t>(attribute);
+  }
+}
+
+vw::VertexInputDescription vw::getVertexInputDescription(VertexFormat format, VertexLayout layout) {
+  VertexInputDescription desc;
+  for (uint32_t i = 0; i < kVertexAttributeCount; ++i) {
+    auto attribute = static_cast<VertexAttribute>(i);
+    uint32_t binding = getAttributeBinding(layout, attribute);
+    if (binding == desc.bindings.size())
+      desc.bindings.emplace_back(binding, 0);
+    // Attributes sharing a binding are packed back to back in VertexAttribute order
+    auto& bindingDesc = desc.bindings[binding];
+    desc.attributes.emplace_back(i, binding, getAttributeFormat(format, attribute), bindingDesc.stride);
+    bindingDesc.stride += getAttributeSize(format, attribute);
+  }
+  return desc;
+}
+
+vw::PositionQuantization vw::computePositionQuantization(VertexFormat format, ArrayProxy<Vec3> positions) {
+  if (format != VertexFormat::Compact || positions.size() == 0)
+    return {};
+  Vec3 min = positions[0], max = positions[0];
+  for (const Vec3& pos : positions) {
+    min = glm::min(pos, min);
+    max = glm::max(pos, max);
+  }
+  return {min, max - min};
+}
+
+void vw::encodeAttribute(VertexFormat format,
+                         VertexAttribute attribute,
+                         ArrayProxy<Vec3> src,
+                         const PositionQuantization& quantization,
+                         std::byte* dst,
+                         size_t stride) {
+  if (format == VertexFormat::Float) {
+    for (const Vec3& v : src) {
+      std::memcpy(dst, &v, sizeof(Vec3));
+      dst += stride;
+    }
+    return;
+  }
+
+  Vec3 invScale{};
+  for (int i = 0; i < 3; ++i)
+    invScale[i] = (quantization.scale[i] > 0.0f) ? 1.0f / quantization.scale[i] : 0.0f;
+
+  for (const Vec3& v : src) {
+    switch (attribute) {
+      case VertexAttribute::Position: {
+        uint64_t packed = glm::packUnorm4x16(glm::vec4{(v - quantization.offset) * invScale, 0.0f});
+        std::memcpy(dst, &packed, sizeof(packed));
+        break;
+      }
+      case VertexAttribute::Normal:
+      case VertexAttribute::Tangent: {
+        uint32_t packed = glm::packSnorm2x16(encodeOctahedral(v));
+        std::memcpy(dst, &packed, sizeof(packed));
+        break;
+      }
+      case VertexAttribute::UV: {
+        uint32_t packed = glm::packHalf2x16(glm::vec2{v.x, v.y});
+        std::memcpy(dst, &packed, sizeof(packed));
+        break;
+      }
+      default:
+        break;
+    }
+    dst += stride;
+  }
+}